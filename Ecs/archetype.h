@@ -1,9 +1,23 @@
 #pragma once
 #include "component_array.h"
+#include "query_cache.h"
+#include <unordered_map>
 
 namespace ecs
 {
 	struct Ecs;
+
+	// A cached structural change from one archetype to another when a single component is added or removed.
+	// sourceArrayIndices has an entry for every component array of the destination: the index of the source array to relocate from, or -1 to construct.
+	struct ArchetypeEdge
+	{
+		int archetypeIndex = -1;
+		uint64_t archetypeSerial = 0;	// Archetype indices are reused, the serial tells if the destination is still the one we cached
+		bool deletesEntity = false;		// No components would be left, the entity gets deleted instead
+		std::vector<int> sourceArrayIndices;
+		std::vector<int> droppedSourceArrayIndices;	// the source arrays the destination doesn't have
+	};
+
 	struct Archetype
 	{
 		Archetype();
@@ -11,10 +25,14 @@ namespace ecs
 
 		entityDataIndex createEntity(entityId id);
 		entityId deleteEntity(const entityDataIndex& index); // returns the entity that moved to this index (can be invalid)
-		entityDataIndex moveFromEntity(entityId id, const entityDataIndex& sourceIndex); // source will become invalid but won't get deleted
+		entityId removeDeadEntity(const entityDataIndex& index); // same as deleteEntity for an entity whose components were already destroyed or relocated
+		int removeDeadEntities(const entityDataIndex& firstIndex, int count); // returns how many entities from the end of the chunk were relocated to firstIndex
+		// Moves the entity here and removes it from the source archetype. Returns the new index and the entity that moved to the original place (can be invalid).
+		// The source archetype is not deleted even if it became empty.
+		std::tuple<entityDataIndex, entityId> moveFromEntity(const entityDataIndex& sourceIndex);
+		std::tuple<entityDataIndex, entityId> moveFromEntity(const entityDataIndex& sourceIndex, const ArchetypeEdge& edge); // same as above with a precomputed column mapping
 		entityDataIndex allocateEntity(const tempList<ComponentData>& sharedComponentDatas);
 
-		ComponentArrayBase* get_(typeId tid);
 		bool hasAllComponents(const typeQueryList& query) const;
 
 		Chunk* getOrCreateChunkForNewEntity();
@@ -38,9 +56,16 @@ namespace ecs
 
 	public:
 		typeIdList containedTypes_;
-		std::vector<std::unique_ptr<Chunk>> chunks; // TODO this needs to be a linked list of chunks most likely
+		ChunkLayout layout;	// declared before the chunks, they use it when they get destroyed
+		std::vector<ChunkPtr> chunks; // TODO this needs to be a linked list of chunks most likely
 		Ecs* ecs = nullptr;
 		int archetypeIndex;
+		uint64_t serial = 0;
 		int currentlyFilledChunkIndex = -1;
+
+		std::unordered_map<typeId, ArchetypeEdge> addEdges;
+		std::unordered_map<typeId, ArchetypeEdge> removeEdges;
+
+		std::vector<CachedQueryBase*> matchingQueries;	// notified when a chunk is created or deleted
 	};
 }
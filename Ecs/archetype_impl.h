@@ -14,13 +14,18 @@ namespace ecs
 	
 	Archetype::Archetype(const typeIdList& typeIds, int archetypeIndex, Ecs* ecs)
 		: containedTypes_(typeIds)
-		, archetypeIndex(archetypeIndex)
+		, layout(typeIds.calcTypeIds(ecs->typeIds_), ecs->typeIds_.size(), ecs->getChunkSize(typeIds))
 		, ecs(ecs)
+		, archetypeIndex(archetypeIndex)
+		, serial(++ecs->lastArchetypeSerial_)
 	{
 	}
 
 	void Archetype::deleteChunk(int chunkIndex)
 	{
+		for (CachedQueryBase* query : matchingQueries)
+			query->removeChunk(chunks[chunkIndex].get());
+
 		chunks[chunkIndex].reset();
 
 		while (chunks.size() && !chunks.back())
@@ -48,10 +53,17 @@ namespace ecs
 	}
 	
 	entityId Archetype::deleteEntity(const entityDataIndex& index)
+	{
+		_ASSERT(index.archetypeIndex == archetypeIndex);
+		chunks[index.chunkIndex]->destroyComponents(index.elementIndex);
+		return removeDeadEntity(index);
+	}
+
+	entityId Archetype::removeDeadEntity(const entityDataIndex& index)
 	{
 		_ASSERT(index.archetypeIndex == archetypeIndex);
 		Chunk* chunk = chunks[index.chunkIndex].get();
-		entityId movedEntityId = chunk->deleteEntity(index.elementIndex);
+		entityId movedEntityId = chunk->removeDeadEntity(index.elementIndex);
 		if (chunk->size == 0)
 		{
 			if (movedEntityId) 
@@ -61,7 +73,17 @@ namespace ecs
 		return movedEntityId;
 	}
 	
-	entityDataIndex Archetype::moveFromEntity(entityId id, const entityDataIndex& sourceIndex)
+	int Archetype::removeDeadEntities(const entityDataIndex& firstIndex, int count)
+	{
+		_ASSERT(firstIndex.archetypeIndex == archetypeIndex);
+		Chunk* chunk = chunks[firstIndex.chunkIndex].get();
+		int fillCount = chunk->removeDeadEntities(firstIndex.elementIndex, count);
+		if (chunk->size == 0)
+			deleteChunk(firstIndex.chunkIndex);
+		return fillCount;
+	}
+
+	std::tuple<entityDataIndex, entityId> Archetype::moveFromEntity(const entityDataIndex& sourceIndex)
 	{
 		Archetype* sourceArchetype = ecs->archetypes_[sourceIndex.archetypeIndex].get();
 		Chunk* sourceChunk = sourceArchetype->chunks[sourceIndex.chunkIndex].get();
@@ -71,7 +93,21 @@ namespace ecs
 		auto [chunk, chunkIndex] = getOrCreateChunkForMovedEntity(sourceIndex);
 		ret.chunkIndex = chunkIndex;
 		ret.elementIndex = chunk->moveEntityFromOtherChunk(sourceChunk, sourceIndex.elementIndex);
-		return ret;
+		return { ret, sourceArchetype->removeDeadEntity(sourceIndex) };
+	}
+	
+	std::tuple<entityDataIndex, entityId> Archetype::moveFromEntity(const entityDataIndex& sourceIndex, const ArchetypeEdge& edge)
+	{
+		_ASSERT(edge.archetypeIndex == archetypeIndex && edge.archetypeSerial == serial);
+		Archetype* sourceArchetype = ecs->archetypes_[sourceIndex.archetypeIndex].get();
+		Chunk* sourceChunk = sourceArchetype->chunks[sourceIndex.chunkIndex].get();
+
+		entityDataIndex ret;
+		ret.archetypeIndex = archetypeIndex;
+		auto [chunk, chunkIndex] = getOrCreateChunkForMovedEntity(sourceIndex);
+		ret.chunkIndex = chunkIndex;
+		ret.elementIndex = chunk->moveEntitiesFromOtherChunk(sourceChunk, sourceIndex.elementIndex, 1, edge.sourceArrayIndices, edge.droppedSourceArrayIndices);
+		return { ret, sourceArchetype->removeDeadEntity(sourceIndex) };
 	}
 	
 	bool Archetype::hasAllComponents(const typeQueryList& query) const
@@ -87,7 +123,7 @@ namespace ecs
 		{
 			if (!chunks[iChunk])
 			{
-				chunks[iChunk] = std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_);
+				chunks[iChunk] = Chunk::create(this, layout, ecs->chunkAllocator_, &ecs->changeVersion_);
 				newChunk = chunks[iChunk].get();
 				newChunkIndex = iChunk;
 				break;
@@ -98,11 +134,14 @@ namespace ecs
 		{
 			newChunkIndex = (int)chunks.size();
 			auto& newChunkPtr = chunks.emplace_back(
-				std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_)
+				Chunk::create(this, layout, ecs->chunkAllocator_, &ecs->changeVersion_)
 			);
 			newChunk = newChunkPtr.get();
 		}
 
+		for (CachedQueryBase* query : matchingQueries)
+			query->addChunk(newChunk);
+
 		return { newChunk, newChunkIndex };
 	}
 
@@ -117,24 +156,9 @@ namespace ecs
 		}
 
 		// The currently used chunk index is not good, let's change it
-		// Let's try to reuse an index
-		for (int iChunk = 0; iChunk < (int)chunks.size(); iChunk++)
-		{
-			if (!chunks[iChunk])
-			{
-				chunks[iChunk] = std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_);
-				currentlyFilledChunkIndex = iChunk;
-				return chunks[currentlyFilledChunkIndex].get();
-			}
-		}
-
-		auto& retPtr = chunks.emplace_back(
-			std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_)
-		);
-
-		currentlyFilledChunkIndex = (int)chunks.size() - 1;
-		return retPtr.get();
-
+		auto [newChunk, newChunkIndex] = createChunk();
+		currentlyFilledChunkIndex = newChunkIndex;
+		return newChunk;
 	}
 
 	std::tuple<Chunk*, int> Archetype::getOrCreateChunkForMovedEntity(entityDataIndex currentIndex)
@@ -150,14 +174,13 @@ namespace ecs
 				continue;
 
 			bool allSharedComponentsAreEqual = true;
-			for (int iSharedType = 0; iSharedType < (int)destChunk->sharedComponents.size(); iSharedType++)
+			for (auto& column : layout.sharedComponents)
 			{
-				auto destArray = destChunk->sharedComponents[iSharedType].get();
-				auto srcArray = currentChunk->getSharedComponentArray(destArray->tid);
-				if (!srcArray)
+				ComponentData srcData = currentChunk->getSharedComponentData(column.tid);
+				if (!srcData.data)
 					continue;
 
-				if (!destArray->isSameAsSharedComponent(srcArray))
+				if (!column.tid->ops.equals(destChunk->getBuffer() + column.offset, srcData.data))
 				{
 					allSharedComponentsAreEqual = false;
 					break;
@@ -177,31 +200,14 @@ namespace ecs
 
 		if (newChunk == nullptr)
 		{
-			for (int iChunk = 0; iChunk < (int)chunks.size(); iChunk++)
-			{
-				if (!chunks[iChunk])
-				{
-					chunks[iChunk] = std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_);
-					newChunk = chunks[iChunk].get();
-					newChunkIndex = iChunk;
-				}
-			}
-
-			if (!newChunk)
-			{
-				auto& retPtr = chunks.emplace_back(
-					std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_)
-				);
-				newChunk = retPtr.get();
-				newChunkIndex = (int)chunks.size() - 1;
-			}
+			std::tie(newChunk, newChunkIndex) = createChunk();
 
 			// Copy all other shared component from the current chunk to the new one
-			for (int iSharedType = 0; iSharedType < (int)newChunk->sharedComponents.size(); iSharedType++)
+			for (auto& column : layout.sharedComponents)
 			{
-				auto destArray = newChunk->sharedComponents[iSharedType].get();
-				auto srcArray = currentChunk->getSharedComponentArray(destArray->tid);
-				destArray->copyFromArray(0, srcArray, 0);
+				ComponentData srcData = currentChunk->getSharedComponentData(column.tid);
+				if (srcData.data)
+					column.tid->ops.copy(newChunk->getBuffer() + column.offset, srcData.data, 1);
 			}
 		}
 
@@ -262,10 +268,7 @@ namespace ecs
 		stream.read((char*)&chunkCount, sizeof(chunkCount));
 		for (int iChunk = 0; iChunk < chunkCount; iChunk++)
 		{
-			auto chunk = chunks.emplace_back(
-				std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_)
-			).get();
-
+			auto [chunk, chunkIndex] = createChunk();
 			chunk->load(stream, typeIdsByLoadedIndex);
 		}
 	}
@@ -275,13 +278,11 @@ namespace ecs
 		auto chunk = chunks[entityIndex.chunkIndex].get();
 		chunk->saveElement(stream, entityIndex.elementIndex);
 
-		for (auto& sharedComponentArray : chunk->sharedComponents)
+		for (auto& column : layout.sharedComponents)
 		{
-			int componentIndex = sharedComponentArray->tid->index;
+			int componentIndex = column.tid->index;
 			stream.write((char*)&componentIndex, sizeof(componentIndex));
-
-			ComponentData sharedComponentData = sharedComponentArray->getElementData(entityIndex.elementIndex);
-			stream.write((char*)sharedComponentData.data, sizeof(sharedComponentArray->tid->size));
+			stream.write((const char*)chunk->getBuffer() + column.offset, column.tid->size);
 		}
 
 		int invalidComponentIndex = -1;
@@ -372,14 +373,12 @@ namespace ecs
 			{
 				// Check all the other shared values
 				bool allSharedComponentsAreEqual = true;
-				for (int iSharedType = 0; iSharedType < (int)currentChunk->sharedComponents.size(); iSharedType++)
+				for (auto& column : layout.sharedComponents)
 				{
-					auto componentToCheck = c->sharedComponents[iSharedType].get();
-
 					bool alreadyChecked = false;
 					for (auto& newData : newSharedComponentDatas)
 					{
-						if (newData.tid == componentToCheck->tid)
+						if (newData.tid == column.tid)
 						{
 							alreadyChecked = true;
 							break;
@@ -389,7 +388,7 @@ namespace ecs
 					if (alreadyChecked)
 						continue;
 
-					if (!componentToCheck->isSameAsSharedComponent(currentChunk->sharedComponents[iSharedType].get()))
+					if (!column.tid->ops.equals(c->getBuffer() + column.offset, currentChunk->getBuffer() + column.offset))
 					{
 						allSharedComponentsAreEqual = false;
 						break;
@@ -410,19 +409,15 @@ namespace ecs
 
 		if (newChunk == nullptr)
 		{
-			auto& newChunkPtr = chunks.emplace_back(
-				std::make_unique<Chunk>(this, containedTypes_.calcTypeIds(ecs->typeIds_), ecs->componentArrayFactory_)
-			);
+			std::tie(newChunk, newChunkIndex) = createChunk();
 
 			// Copy all other shared component from the current chunk to the new one
-			for (int iSharedType = 0; iSharedType < (int)currentChunk->sharedComponents.size(); iSharedType++)
+			for (auto& column : layout.sharedComponents)
 			{
-				auto componentToCopy = currentChunk->sharedComponents[iSharedType].get();
-
 				bool hasNewData = false;
 				for (auto& newData : newSharedComponentDatas)
 				{
-					if (newData.tid == componentToCopy->tid)
+					if (newData.tid == column.tid)
 					{
 						hasNewData = true;
 						break;
@@ -433,21 +428,19 @@ namespace ecs
 					continue;
 
 				// Didnt specify new data, copy from the old one
-				newChunkPtr->sharedComponents[iSharedType]->copyFromArray(0, componentToCopy, 0);
+				column.tid->ops.copy(newChunk->getBuffer() + column.offset, currentChunk->getBuffer() + column.offset, 1);
 			}
 
 			// Set the new data from the shared components
 			for (auto& newData : newSharedComponentDatas)
 			{
-				ComponentData sharedValue = newChunkPtr->getSharedComponentData(newData.tid);
+				ComponentData sharedValue = newChunk->getSharedComponentData(newData.tid);
 				memcpy(sharedValue.data, newData.data, newData.tid->size);
 			}
-			newChunk = newChunkPtr.get();
-			newChunkIndex = (int)chunks.size() - 1;
 		}
 
 		int newElementIndex = newChunk->moveEntityFromOtherChunk(currentChunk, currentIndex.elementIndex);
-		entityId movedEntityId = currentChunk->deleteEntity(currentIndex.elementIndex);
+		entityId movedEntityId = currentChunk->removeDeadEntity(currentIndex.elementIndex);
 		if (currentChunk->size == 0)
 		{
 			_ASSERT_EXPR(movedEntityId == 0, "We moved an entity into a chunk that's empty");
@@ -0,0 +1,177 @@
+#pragma once
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace ecs
+{
+	// Hands out cache line aligned chunk blocks carved from large slabs and recycles the freed blocks.
+	// Blocks of different sizes come from separate pools, the slabs are only returned to the system when the allocator is destroyed.
+	// On Linux the slabs can be backed by transparent huge pages.
+	// Not thread safe, chunks are only created and deleted by the thread that changes the ecs.
+	struct ChunkAllocator
+	{
+		static inline const size_t blockAlignment = 64;
+		static inline const size_t slabSize = 1 << 21;	// 2MB, the size of a huge page on x64
+
+		struct Stats
+		{
+			size_t slabCount = 0;
+			size_t hugePageSlabCount = 0;	// slabs that were successfully advised to use huge pages
+			size_t reservedBytes = 0;		// the size of all the slabs
+			size_t blocksInUse = 0;
+			size_t freeBlocks = 0;			// freed blocks waiting to be reused
+			size_t peakBlocksInUse = 0;
+			size_t allocationCount = 0;
+			size_t recycledAllocationCount = 0;	// allocations that reused a freed block
+		};
+
+		ChunkAllocator() = default;
+		ChunkAllocator(const ChunkAllocator&) = delete;
+		ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+		~ChunkAllocator()
+		{
+			for (auto& slab : slabs)
+				freeSlab(slab);
+		}
+
+		void* allocate(size_t size)
+		{
+			Pool& pool = getPool(size);
+			stats.allocationCount++;
+			stats.blocksInUse++;
+			if (stats.blocksInUse > stats.peakBlocksInUse)
+				stats.peakBlocksInUse = stats.blocksInUse;
+
+			if (pool.freeBlocks.size())
+			{
+				void* block = pool.freeBlocks.back();
+				pool.freeBlocks.pop_back();
+				stats.freeBlocks--;
+				stats.recycledAllocationCount++;
+				return block;
+			}
+
+			if (pool.slabRemaining < pool.blockSize)
+			{
+				size_t newSlabSize = pool.blockSize > slabSize ? roundUp(pool.blockSize, slabSize) : slabSize;
+				pool.slabCursor = allocateSlab(newSlabSize);
+				pool.slabRemaining = newSlabSize;
+			}
+
+			void* block = pool.slabCursor;
+			pool.slabCursor += pool.blockSize;
+			pool.slabRemaining -= pool.blockSize;
+			return block;
+		}
+
+		// size must be the same that was used to allocate the block
+		void deallocate(void* block, size_t size)
+		{
+			getPool(size).freeBlocks.push_back(static_cast<uint8_t*>(block));
+			stats.blocksInUse--;
+			stats.freeBlocks++;
+		}
+
+		// Only affects the slabs allocated after this call
+		void setUseHugePages(bool use) { useHugePages = use; }
+		bool getUseHugePages() const { return useHugePages; }
+
+		const Stats& getStats() const { return stats; }
+
+	private:
+		struct Pool
+		{
+			size_t blockSize;
+			std::vector<uint8_t*> freeBlocks;
+			uint8_t* slabCursor = nullptr;
+			size_t slabRemaining = 0;
+		};
+
+		struct Slab
+		{
+			void* memory;
+			size_t size;
+			bool mapped;
+		};
+
+		static size_t roundUp(size_t value, size_t alignment)
+		{
+			return (value + alignment - 1) / alignment * alignment;
+		}
+
+		// There are only a handful of chunk sizes, a linear search is fine
+		Pool& getPool(size_t size)
+		{
+			size_t blockSize = roundUp(size, blockAlignment);
+			for (auto& pool : pools)
+			{
+				if (pool.blockSize == blockSize)
+					return pool;
+			}
+
+			Pool& pool = pools.emplace_back();
+			pool.blockSize = blockSize;
+			return pool;
+		}
+
+		uint8_t* allocateSlab(size_t size)
+		{
+			Slab slab{ nullptr, size, false };
+#ifdef __linux__
+			if (useHugePages)
+			{
+				// Map an extra huge page so we can trim the mapping to a huge page aligned range
+				size_t mappedSize = size + slabSize;
+				void* mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (mapped != MAP_FAILED)
+				{
+					uintptr_t start = roundUp((uintptr_t)mapped, slabSize);
+					size_t head = start - (uintptr_t)mapped;
+					if (head)
+						munmap(mapped, head);
+					if (mappedSize - head - size)
+						munmap((void*)(start + size), mappedSize - head - size);
+
+					slab.memory = (void*)start;
+					slab.mapped = true;
+#ifdef MADV_HUGEPAGE
+					if (madvise(slab.memory, size, MADV_HUGEPAGE) == 0)
+						stats.hugePageSlabCount++;
+#endif
+				}
+			}
+#endif
+			if (!slab.memory)
+				slab.memory = ::operator new(size, std::align_val_t(blockAlignment));
+
+			slabs.push_back(slab);
+			stats.slabCount++;
+			stats.reservedBytes += size;
+			return static_cast<uint8_t*>(slab.memory);
+		}
+
+		void freeSlab(const Slab& slab)
+		{
+#ifdef __linux__
+			if (slab.mapped)
+			{
+				munmap(slab.memory, slab.size);
+				return;
+			}
+#endif
+			::operator delete(slab.memory, std::align_val_t(blockAlignment));
+		}
+
+		std::vector<Pool> pools;
+		std::vector<Slab> slabs;
+		Stats stats;
+		bool useHugePages = false;
+	};
+}
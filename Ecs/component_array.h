@@ -1,251 +1,229 @@
 #pragma once
 #include "ecs_util.h"
-#include <functional>
+#include "chunk_allocator.h"
+#include <memory>
+#include <new>
 
 namespace ecs
 {
-	struct ComponentArrayBase
+	// Buffer size of the chunks of an archetype. Bigger chunks mean fewer chunks to walk for small entities and more than a handful of entities per chunk for big ones.
+	// Auto picks the smallest size that fits autoChunkEntityCount entities.
+	enum class ChunkSizeClass
 	{
-		ComponentArrayBase(typeId tid, uint8_t* buffer) : tid(tid), buffer(buffer), elementSize(tid->size) {}
-		virtual ~ComponentArrayBase() {}
-		virtual void createEntity(int elementIndex) = 0;
-		virtual void deleteEntity(int elementIndex, int lastValidElementIndex) = 0;
-		virtual void copyFromArray(int sourceElementIndex, const ComponentArrayBase* sourceArray, int destElementIndex) = 0;
-		virtual void moveFromArray(int sourceElementIndex, const ComponentArrayBase* sourceArray, int destElementIndex) = 0;
-		virtual void save(istream& stream, size_t count) const = 0;
-		virtual void load(istream& stream, size_t count) = 0;
-		typeId getTypeId() { return tid; }
-
-		virtual bool isSameAsSharedComponent(const ComponentArrayBase* other) const = 0;
-
-		ComponentData getElementData(int elementIndex)
-		{
-			ComponentData ret;
-			ret.tid = tid;
-			ret.data = buffer + elementSize * elementIndex;
-			return ret;
-		}
-
-		virtual void saveElement(istream& stream, int elementIndex) const = 0;
-		virtual void loadElement(istream& stream, int elementIndex) = 0;
-
-		uint8_t* buffer;
-		int elementSize;
-		typeId tid;
+		Auto = 0,
+		Size16K = 1 << 14,
+		Size64K = 1 << 16,
+		Size256K = 1 << 18,
 	};
 
-	template<class T>
-	struct ComponentArray : public ComponentArrayBase
+	// The layout of the chunks of an archetype. It's computed once per archetype and shared by all of its chunks,
+	// so creating a chunk is a single allocation and finding a column is a single indexed load.
+	struct ChunkLayout
 	{
-		ComponentArray(typeId tid, uint8_t* buffer) : ComponentArrayBase(tid, buffer) {}
+		static inline const int autoChunkEntityCount = 256;
+		static inline const int columnAlignment = 64;	// every component and field array starts on a cache line, so chunk loops can use aligned SIMD loads
 
-		void createEntity(int elementIndex) override
+		struct Column
 		{
-			new (&buffer[elementIndex * elementSize]) T{};
-		}
+			typeId tid;
+			int offset;		// in bytes from the start of the chunk buffer
+			std::vector<int> fieldOffsets;	// the array of each field for components stored field by field
+		};
 
-		void deleteEntity(int elementIndex, int lastValidElementIndex) override
+		ChunkLayout() = default;
+		ChunkLayout(const std::vector<typeId>& containedTypeIds, size_t registeredTypeCount, ChunkSizeClass sizeClass)
+			: typeIds(containedTypeIds)
+			, arrayIndexByType(registeredTypeCount, -1)
+			, sharedIndexByType(registeredTypeCount, -1)
+			, bufferCapacity(chooseBufferCapacity(containedTypeIds, sizeClass))
 		{
-			auto tBuffer = reinterpret_cast<T*>(buffer);
-			std::swap(tBuffer[elementIndex], tBuffer[lastValidElementIndex]);
-			tBuffer[lastValidElementIndex].~T();
-		}
+			entityCapacity = calcEntityCapacity(typeIds, bufferCapacity);
+			int componentBufferOffset = 0;
 
-		void moveFromArray(int sourceElementIndex, const ComponentArrayBase* sourceArray, int destElementIndex) override
-		{
-			auto sourceArrayCasted = static_cast<const ComponentArray<T>*>(sourceArray);
-			auto tSourceBuffer = reinterpret_cast<T*>(sourceArrayCasted->buffer);
-			auto tDestBuffer = reinterpret_cast<T*>(buffer);
+			// in the beginning there are entity ids
+			componentBufferOffset += sizeof(entityId) * entityCapacity;
 
-			if constexpr (!std::is_trivially_move_assignable_v<T>)
+			for (auto& t : typeIds)
 			{
-				new (&buffer[destElementIndex * elementSize]) T{};
-			}
-
-			tDestBuffer[destElementIndex] = std::move(tSourceBuffer[sourceElementIndex]);
-		}
-
-		void copyFromArray(int sourceElementIndex, const ComponentArrayBase* sourceArray, int destElementIndex) override
-		{
-			auto sourceArrayCasted = static_cast<const ComponentArray<T>*>(sourceArray);
-			auto tSourceBuffer = reinterpret_cast<T*>(sourceArrayCasted->buffer);
-			auto tDestBuffer = reinterpret_cast<T*>(buffer);
-			tDestBuffer[destElementIndex] = tSourceBuffer[sourceElementIndex];
-		}
+				if (t->size == 0)
+					continue;
 
-		T* getElement(int elementIndex)
-		{
-			auto tBuffer = reinterpret_cast<T*>(buffer);
-			return &tBuffer[elementIndex];
-		}
+				if (t->type == ComponentType::Shared)
+				{
+					componentBufferOffset = alignOffset(componentBufferOffset, t->alignment);
+					sharedIndexByType[t->index] = (int)sharedComponents.size();
+					sharedComponents.push_back({ t, componentBufferOffset });
+					componentBufferOffset += t->size * 1;
+				}
+				else if (t->fields.size())
+				{
+					componentBufferOffset = alignOffset(componentBufferOffset, columnAlignment);
+					arrayIndexByType[t->index] = (int)arrays.size();
+					Column& column = arrays.emplace_back(Column{ t, componentBufferOffset });
+					for (auto& field : t->fields)
+					{
+						componentBufferOffset = alignOffset(componentBufferOffset, std::max(field.alignment, columnAlignment));
+						column.fieldOffsets.push_back(componentBufferOffset);
+						componentBufferOffset += field.size * entityCapacity;
+					}
+				}
+				else
+				{
+					componentBufferOffset = alignOffset(componentBufferOffset, std::max(t->alignment, columnAlignment));
+					arrayIndexByType[t->index] = (int)arrays.size();
+					arrays.push_back({ t, componentBufferOffset });
+					componentBufferOffset += t->size * entityCapacity;
+				}
+			}
 
-		const T* getElement(int elementIndex) const
-		{
-			auto tBuffer = reinterpret_cast<const T*>(buffer);
-			return &tBuffer[elementIndex];
+			// the change version of every array is at the end
+			columnVersionsOffset = alignOffset(componentBufferOffset, (int)alignof(uint64_t));
 		}
 
-		bool isElementEqualStreamed(const uint8_t* data, int elementIndex) const
+		static int alignOffset(int offset, int alignment)
 		{
-			return memcmp(data, getElement(elementIndex), elementSize) == 0;
+			return (offset + alignment - 1) / alignment * alignment;
 		}
 
-		bool isSameAsSharedComponent(const ComponentArrayBase* other) const override
+		static int calcEntityCapacity(const std::vector<typeId>& typeIds, int bufferCapacity)
 		{
-			if (other->tid != tid)
-				return false;
+			int worstCaseCapacity = bufferCapacity;
 
-			if (tid->type != ComponentType::Shared)
+			int entitySize = sizeof(entityId);
+			worstCaseCapacity -= (int)alignof(uint64_t);	// padding before the change versions
+			for (auto& t : typeIds)
 			{
-				_ASSERT(0);
-				return false;
-			}
-
-			return equals(*getElement(0), *static_cast<const ComponentArray<T>*>(other)->getElement(0));
-		}
+				if (t->size == 0)
+					continue;
 
-		void save(istream& stream, size_t entityCount) const override
-		{
-			if constexpr (std::is_trivially_copyable_v<T>)
-			{
-				stream.write((char*)buffer, entityCount * sizeof(T));
-			}
-			/*else
-			{
-				for (int i = 0; i < entityCount; i++)
+				if (t->type != ComponentType::Shared)
+				{
+					entitySize += t->size;
+					worstCaseCapacity -= std::max(t->alignment, columnAlignment) * (1 + (int)t->fields.size());	// padding before the array and every field array
+					worstCaseCapacity -= (int)sizeof(uint64_t);	// the change version of the array
+				}
+				else
 				{
-					getElement(i)->save(stream);
+					worstCaseCapacity -= t->size + t->alignment;	// we need to store one of the shared components at the end of our buffer
 				}
-			}*/
-		}
-
-		void saveElement(istream& stream, int elementIndex) const override
-		{
-			if constexpr (std::is_trivially_copyable_v<T>)
-			{
-				stream.write((char*)(buffer + elementIndex * elementSize), elementSize);
 			}
-		}
 
-		void load(istream& stream, size_t count) override
-		{
-			if constexpr (std::is_trivially_copyable_v<T>)
-			{
-				stream.read((char*)buffer, count * sizeof(T));
-			}
-			/*else
-			{
-				for(int i = 0; i < count; i++)
-				{
-					getElement(i)->load(stream);
-				}
-			}*/
+			return std::max(worstCaseCapacity / entitySize, 0);
 		}
 
-		void loadElement(istream& stream, int elementIndex) override
+		// An explicit size that can't fit a single entity falls back to Auto
+		static int chooseBufferCapacity(const std::vector<typeId>& typeIds, ChunkSizeClass sizeClass)
 		{
-			if constexpr (std::is_trivially_copyable_v<T>)
+			if (sizeClass != ChunkSizeClass::Auto && calcEntityCapacity(typeIds, (int)sizeClass) > 0)
+				return (int)sizeClass;
+
+			for (ChunkSizeClass autoSize : { ChunkSizeClass::Size16K, ChunkSizeClass::Size64K, ChunkSizeClass::Size256K })
 			{
-				stream.read((char*)(buffer + elementIndex * elementSize), elementSize);
+				if (calcEntityCapacity(typeIds, (int)autoSize) >= autoChunkEntityCount)
+					return (int)autoSize;
 			}
+
+			// Huge entities, take the biggest size class or whatever fits at least one of them
+			int bufferCapacity = (int)ChunkSizeClass::Size256K;
+			while (calcEntityCapacity(typeIds, bufferCapacity) < 1)
+				bufferCapacity *= 2;
+			return bufferCapacity;
 		}
-	};
 
-	struct ComponentArrayFactory
-	{
-		std::unique_ptr<ComponentArrayBase> create(const typeId& componentId, uint8_t* buffer) const
+		// -1 if the archetype doesn't have an array for this type (types registered after the archetype was created aren't in the table)
+		int getArrayIndex(typeId tid) const
 		{
-			auto it = factoryFunctions.find(componentId);
-			if (it == factoryFunctions.end())
-				return nullptr;
-			return it->second(buffer);
+			return (size_t)tid->index < arrayIndexByType.size() ? arrayIndexByType[tid->index] : -1;
 		}
 
-		template<class T>
-		void addFactoryFunction(const typeId& componentId)
+		int getSharedIndex(typeId tid) const
 		{
-			std::function<std::unique_ptr<ComponentArrayBase>(uint8_t*)> fn;
-			fn = [componentId](uint8_t* buffer)
-			{
-				return std::make_unique<ComponentArray<T>>(componentId, buffer);
-			};
-
-			factoryFunctions[componentId] = fn;
+			return (size_t)tid->index < sharedIndexByType.size() ? sharedIndexByType[tid->index] : -1;
 		}
 
-		std::unordered_map<typeId, std::function<std::unique_ptr<ComponentArrayBase>(uint8_t*)>> factoryFunctions;
+		std::vector<typeId> typeIds;			// All contained types
+		std::vector<Column> arrays;				// Component arrays, empty and shared components have none
+		std::vector<Column> sharedComponents;	// One element of each shared component
+		std::vector<int> arrayIndexByType;
+		std::vector<int> sharedIndexByType;
+		int entityCapacity = 0;
+		int bufferCapacity = 0;
+		int columnVersionsOffset = 0;	// one uint64_t per component array
 	};
 
+	// A chunk is a single aligned block from the ChunkAllocator: this header followed by a buffer laid out by the ChunkLayout of its archetype.
+	// The buffer starts with the entity ids, followed by the component arrays and one element of each shared component.
 	struct Chunk
 	{
-		Chunk()
+		static inline const size_t alignment = 64;
+
+		struct Deleter
 		{
-			entityCapacity = 0;
-		}
+			void operator()(Chunk* chunk) const { destroy(chunk); }
+		};
 
-		Chunk(struct Archetype* archetype, const std::vector<typeId>& typeIds, const ComponentArrayFactory& componentArrayFactory)
-			: archetype(archetype)
+		static std::unique_ptr<Chunk, Deleter> create(struct Archetype* archetype, const ChunkLayout& layout, ChunkAllocator& allocator, const uint64_t* changeVersion)
 		{
-			int maxAlign = (int)alignof(std::max_align_t);
-			int worstCaseCapacity = bufferCapacity - maxAlign * (int)typeIds.size();
+			static_assert(ChunkAllocator::blockAlignment % alignment == 0, "The chunk allocator has to align the chunks");
+			static_assert(alignment % ChunkLayout::columnAlignment == 0, "The buffer has to be aligned for the columns");
+			void* memory = allocator.allocate(headerSize() + layout.bufferCapacity);
+			Chunk* chunk = new (memory) Chunk();
+			chunk->archetype = archetype;
+			chunk->layout = &layout;
+			chunk->allocator = &allocator;
+			chunk->entityCapacity = layout.entityCapacity;
+			chunk->changeVersion = changeVersion;
+			std::fill_n(chunk->getColumnVersions(), layout.arrays.size(), *changeVersion);
 
-			int entitySize = sizeof(entityId);
-			int componentArrayCount = 0;
-			int sharedComponentCount = 0;
-			for (auto& t : typeIds)
+			for (auto& column : layout.sharedComponents)
 			{
-				if (t->type != ComponentType::Shared)
-				{
-					entitySize += t->size;
-					componentArrayCount++;
-				}
-				else
-				{
-					worstCaseCapacity -= t->size;	// we need to store one of the shared components at the end of our buffer
-					sharedComponentCount++;
-				}
+				column.tid->ops.construct(chunk->getBuffer() + column.offset, 1);
 			}
 
-			componentArrays.reserve(componentArrayCount);
-			sharedComponents.reserve(sharedComponentCount);
+			return std::unique_ptr<Chunk, Deleter>(chunk);
+		}
 
-			entityCapacity = worstCaseCapacity / entitySize;
-			int componentBufferOffset = 0;
-			
-			// in the beginning there are entity ids
-			componentBufferOffset += sizeof(entityId) * entityCapacity;
+		// Destroys the components that are still in the chunk and frees it
+		static void destroy(Chunk* chunk)
+		{
+			for (int iArray = 0; iArray < (int)chunk->layout->arrays.size(); iArray++)
+			{
+				chunk->destroyElements(iArray, 0, chunk->size);
+			}
 
-			for (auto& t : typeIds)
+			for (auto& column : chunk->layout->sharedComponents)
 			{
-				if (t->size == 0)
-					continue;
+				column.tid->ops.destroy(chunk->getBuffer() + column.offset, 1);
+			}
+
+			ChunkAllocator* allocator = chunk->allocator;
+			size_t chunkSize = headerSize() + chunk->layout->bufferCapacity;
+			chunk->~Chunk();
+			allocator->deallocate(chunk, chunkSize);
+		}
 
-				// align the offset to this type
-				int under = componentBufferOffset % t->alignment;
-				componentBufferOffset += ((t->alignment - under) % t->alignment);
+		static constexpr size_t headerSize()
+		{
+			return (sizeof(Chunk) + alignment - 1) & ~(alignment - 1);
+		}
 
+		uint8_t* getBuffer()
+		{
+			return reinterpret_cast<uint8_t*>(this) + headerSize();
+		}
 
-				if (t->type == ComponentType::Shared)
-				{
-					auto& sharedComponentArray = sharedComponents.emplace_back(componentArrayFactory.create(t, &buffer[0] + componentBufferOffset));
-					sharedComponentArray->createEntity(0);
-					componentBufferOffset += t->size * 1;
-				}
-				else
-				{
-					componentArrays.emplace_back(componentArrayFactory.create(t, &buffer[0] + componentBufferOffset));
-					componentBufferOffset += t->size * entityCapacity;
-				}
-			}
+		const uint8_t* getBuffer() const
+		{
+			return reinterpret_cast<const uint8_t*>(this) + headerSize();
 		}
 
 		int createEntity(entityId id)
 		{
 			int entityIndex = size;
 			getEntityIds()[entityIndex] = id;
-			for (auto& componentArray : componentArrays)
+			for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
 			{
-				componentArray->createEntity(entityIndex);
+				constructElements(iArray, entityIndex, 1);
 			}
 			size++;
 			return entityIndex;
@@ -264,110 +242,267 @@ namespace ecs
 			if (size == 0)
 				return 0;
 
-			// We need to do everything even if this is the last item to make sure we run the destructors in the componantArrays.
-			size--;
+			destroyComponents(elementIndex);
+			return removeDeadEntity(elementIndex);
+		}
 
-			entityId* entityIds = getEntityIds();
-			entityId movedEntityId = 0;
-			if (size != elementIndex)
-			{	// If we're not currently deleting the last item, we swap the last one here and return the swapped item to be updated
-				movedEntityId = entityIds[size];
-				entityIds[elementIndex] = movedEntityId;
+		void destroyComponents(int elementIndex)
+		{
+			for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
+			{
+				destroyElements(iArray, elementIndex, 1);
 			}
+		}
 
-			for (auto& componentArray : componentArrays)
+		// The components of the element have to be destroyed or relocated already.
+		// The last entity is relocated to its place, the return value is its id (0 if the removed entity was the last one).
+		entityId removeDeadEntity(int elementIndex)
+		{
+			size--;
+			if (size == elementIndex)
+				return 0;
+
+			entityId* entityIds = getEntityIds();
+			entityIds[elementIndex] = entityIds[size];
+			for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
 			{
-				componentArray->deleteEntity(elementIndex, size);
+				relocateElements(iArray, elementIndex, this, iArray, size, 1);
 			}
 
-			return movedEntityId;
+			return entityIds[elementIndex];
 		}
 
+		// Relocates the components to the end of this chunk, constructs the ones the source doesn't have and destroys the ones we don't have.
+		// The source element is left dead, call removeDeadEntity on the source chunk after this.
 		int moveEntityFromOtherChunk(Chunk* sourceChunk, int sourceElementIndex)
 		{
 			int ret = size;
-			entityId* destEntityIds = getEntityIds();
-			entityId* sourceEntityIds = sourceChunk->getEntityIds();
-			destEntityIds[size] = sourceEntityIds[sourceElementIndex];
+			getEntityIds()[size] = sourceChunk->getEntityIds()[sourceElementIndex];
 
-			for (int iDestType = 0; iDestType < (int)componentArrays.size(); iDestType++)
+			for (int iDestType = 0; iDestType < (int)layout->arrays.size(); iDestType++)
 			{
-				ComponentArrayBase* destArray = componentArrays[iDestType].get();
-				ComponentArrayBase* sourceArray = sourceChunk->getArray(destArray->tid);
-				if (sourceArray)
-				{
-					destArray->moveFromArray(sourceElementIndex, sourceArray, size);
-				}
+				int sourceArrayIndex = sourceChunk->layout->getArrayIndex(layout->arrays[iDestType].tid);
+				if (sourceArrayIndex >= 0)
+					relocateElements(iDestType, size, sourceChunk, sourceArrayIndex, sourceElementIndex, 1);
 				else
-				{
-					destArray->createEntity(size);
-				}
+					constructElements(iDestType, size, 1);
+			}
+
+			for (int iSourceType = 0; iSourceType < (int)sourceChunk->layout->arrays.size(); iSourceType++)
+			{
+				if (layout->getArrayIndex(sourceChunk->layout->arrays[iSourceType].tid) < 0)
+					sourceChunk->destroyElements(iSourceType, sourceElementIndex, 1);
 			}
 
 			// Shared components should already be fine because the target chunk was selected (or created) with those in mind.
-			
+
 			size++;
 			return ret;
 		}
 
-		entityId* getEntityIds()
+		// Moves a contiguous range of entities with the column mapping of an ArchetypeEdge, one call per column.
+		// The source elements are left dead, call removeDeadEntities on the source chunk after this. Returns the index of the first moved entity.
+		int moveEntitiesFromOtherChunk(Chunk* sourceChunk, int sourceFirstElementIndex, int count, const std::vector<int>& sourceArrayIndices, const std::vector<int>& droppedSourceArrayIndices)
 		{
-			return reinterpret_cast<entityId*>(&buffer[0]);
+			_ASSERT(sourceArrayIndices.size() == layout->arrays.size());
+			_ASSERT(size + count <= entityCapacity);
+			int ret = size;
+			memcpy(getEntityIds() + size, sourceChunk->getEntityIds() + sourceFirstElementIndex, count * sizeof(entityId));
+
+			for (int iDestType = 0; iDestType < (int)layout->arrays.size(); iDestType++)
+			{
+				int sourceArrayIndex = sourceArrayIndices[iDestType];
+				if (sourceArrayIndex >= 0)
+					relocateElements(iDestType, size, sourceChunk, sourceArrayIndex, sourceFirstElementIndex, count);
+				else
+					constructElements(iDestType, size, count);
+			}
+
+			for (int sourceArrayIndex : droppedSourceArrayIndices)
+			{
+				sourceChunk->destroyElements(sourceArrayIndex, sourceFirstElementIndex, count);
+			}
+
+			size += count;
+			return ret;
 		}
 
-		ComponentArrayBase* getArray(typeId tid)
+		// Removes a contiguous range of dead entities by relocating entities from the end of the chunk into the hole.
+		// Returns how many entities were relocated, they are at the start of the hole now.
+		int removeDeadEntities(int firstElementIndex, int count)
 		{
-			for (auto& componentArray : componentArrays)
+			int tailStart = std::max(firstElementIndex + count, size - count);
+			int fillCount = size - tailStart;
+			if (fillCount > 0)
 			{
-				if (componentArray->tid == tid)
-					return componentArray.get();
+				entityId* entityIds = getEntityIds();
+				memcpy(entityIds + firstElementIndex, entityIds + tailStart, fillCount * sizeof(entityId));
+				for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
+				{
+					relocateElements(iArray, firstElementIndex, this, iArray, tailStart, fillCount);
+				}
 			}
 
-			return nullptr;
+			size -= count;
+			return fillCount;
+		}
+
+		entityId* getEntityIds()
+		{
+			return reinterpret_cast<entityId*>(getBuffer());
+		}
+
+		uint64_t* getColumnVersions()
+		{
+			return reinterpret_cast<uint64_t*>(getBuffer() + layout->columnVersionsOffset);
+		}
+
+		// The change version of the ecs when the array was last written, see Ecs::getChangeVersion
+		uint64_t getColumnVersion(int arrayIndex) const
+		{
+			return reinterpret_cast<const uint64_t*>(getBuffer() + layout->columnVersionsOffset)[arrayIndex];
+		}
+
+		// Every write to an array stamps it, including construction and relocation. -1 is ignored.
+		void markChanged(int arrayIndex)
+		{
+			if (arrayIndex >= 0)
+				getColumnVersions()[arrayIndex] = *changeVersion;
+		}
+
+		const entityId* getEntityIds() const
+		{
+			return reinterpret_cast<const entityId*>(getBuffer());
+		}
+
+		uint8_t* getArray(int arrayIndex)
+		{
+			return getBuffer() + layout->arrays[arrayIndex].offset;
+		}
+
+		// Only for components stored as whole structs
+		uint8_t* getElement(int arrayIndex, int elementIndex)
+		{
+			auto& column = layout->arrays[arrayIndex];
+			_ASSERT(column.fieldOffsets.empty());
+			return getBuffer() + column.offset + column.tid->size * elementIndex;
 		}
 
-		ComponentArrayBase* getSharedComponentArray(typeId tid)
+		uint8_t* getFieldArray(int arrayIndex, int fieldIndex)
 		{
-			for (auto& componentArray : sharedComponents)
+			return getBuffer() + layout->arrays[arrayIndex].fieldOffsets[fieldIndex];
+		}
+
+		// The element ops below handle both storage modes, the field by field components are trivially copyable so their fields are memcpy'd
+
+		void constructElements(int arrayIndex, int firstElementIndex, int count)
+		{
+			markChanged(arrayIndex);
+			auto& column = layout->arrays[arrayIndex];
+			if (column.fieldOffsets.empty())
 			{
-				if (componentArray->tid == tid)
-					return componentArray.get();
+				column.tid->ops.construct(getElement(arrayIndex, firstElementIndex), count);
+				return;
 			}
 
-			return nullptr;
+			for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
+			{
+				const FieldDescriptor& field = column.tid->fields[iField];
+				uint8_t* fieldArray = getFieldArray(arrayIndex, iField) + field.size * firstElementIndex;
+				for (int i = 0; i < count; i++)
+					memcpy(fieldArray + field.size * i, column.tid->defaultValue.data() + field.offset, field.size);
+			}
 		}
 
-		template<class T>
-		T* getSharedComponent(typeId tid)
+		void destroyElements(int arrayIndex, int firstElementIndex, int count)
+		{
+			if (layout->arrays[arrayIndex].fieldOffsets.empty())
+				layout->arrays[arrayIndex].tid->ops.destroy(getElement(arrayIndex, firstElementIndex), count);
+		}
+
+		// The destination elements have to be dead, the source elements are left dead
+		void relocateElements(int arrayIndex, int firstElementIndex, Chunk* sourceChunk, int sourceArrayIndex, int sourceFirstElementIndex, int count)
 		{
-			for (auto& componentArray : sharedComponents)
+			markChanged(arrayIndex);
+			auto& column = layout->arrays[arrayIndex];
+			if (column.fieldOffsets.empty())
 			{
-				if (componentArray->tid == tid)
-					return static_cast<ComponentArray<T>*>(componentArray.get())->getElement(0);
+				column.tid->ops.relocate(getElement(arrayIndex, firstElementIndex), sourceChunk->getElement(sourceArrayIndex, sourceFirstElementIndex), count);
+				return;
 			}
 
-			return nullptr;
+			for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
+			{
+				int fieldSize = column.tid->fields[iField].size;
+				memmove(getFieldArray(arrayIndex, iField) + fieldSize * firstElementIndex, sourceChunk->getFieldArray(sourceArrayIndex, iField) + fieldSize * sourceFirstElementIndex, fieldSize * count);
+			}
 		}
 
-		ComponentData getSharedComponentData(typeId tid)
+		// Copies a field by field component in and out of a whole struct
+		void gatherElement(int arrayIndex, int elementIndex, uint8_t* out) const
 		{
-			ComponentData ret {tid};
-			for (auto& componentArray : sharedComponents)
+			auto& column = layout->arrays[arrayIndex];
+			for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
 			{
-				if (componentArray->tid == tid)
-					ret = componentArray->getElementData(0);
+				const FieldDescriptor& field = column.tid->fields[iField];
+				memcpy(out + field.offset, getBuffer() + column.fieldOffsets[iField] + field.size * elementIndex, field.size);
 			}
+		}
 
-			return ret;
+		void scatterElement(int arrayIndex, int elementIndex, const uint8_t* in)
+		{
+			markChanged(arrayIndex);
+			auto& column = layout->arrays[arrayIndex];
+			for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
+			{
+				const FieldDescriptor& field = column.tid->fields[iField];
+				memcpy(getFieldArray(arrayIndex, iField) + field.size * elementIndex, in + field.offset, field.size);
+			}
+		}
+
+		uint8_t* getArray(typeId tid)
+		{
+			int arrayIndex = layout->getArrayIndex(tid);
+			return arrayIndex >= 0 ? getArray(arrayIndex) : nullptr;
+		}
+
+		// nullptr if the chunk doesn't have an array for this component. Components stored field by field have no whole struct to point to.
+		template<class T>
+		T* getComponent(typeId tid, int elementIndex)
+		{
+			_ASSERT_EXPR(tid->fields.empty(), L"The component is stored field by field, use View::getFieldSpan or setComponentValues!");
+			if (tid->fields.size())
+				return nullptr;	// there is no struct array to point into
+
+			T* componentArray = reinterpret_cast<T*>(getArray(tid));
+			return componentArray ? componentArray + elementIndex : nullptr;
+		}
+
+		template<class T>
+		T* getSharedComponent(typeId tid)
+		{
+			return reinterpret_cast<T*>(getSharedComponentData(tid).data);
+		}
+
+		// The data is nullptr if the chunk doesn't have this shared component
+		ComponentData getSharedComponentData(typeId tid)
+		{
+			int sharedIndex = layout->getSharedIndex(tid);
+			if (sharedIndex < 0)
+				return { tid, nullptr };
+			return { tid, getBuffer() + layout->sharedComponents[sharedIndex].offset };
 		}
 
 		template<class T>
 		int setInitialComponentValue(int elementIndex, const T& value, typeId tid)
 		{
-			if (tid->type != ComponentType::Regular || tid->size == 0)
+			if (tid->type == ComponentType::Shared || tid->size == 0)
 				return 0;
-			auto componentArray = getArray(tid);
-			new (&componentArray->buffer[elementIndex * componentArray->elementSize]) T{ value };
+			markChanged(layout->getArrayIndex(tid));
+			if (tid->fields.size())
+				scatterElement(layout->getArrayIndex(tid), elementIndex, reinterpret_cast<const uint8_t*>(&value));
+			else
+				new (getComponent<T>(tid, elementIndex)) T{ value };
 			return 0;
 		}
 
@@ -377,42 +512,104 @@ namespace ecs
 			auto tmp = { setInitialComponentValue(elementIndex, values, archetype->ecs->getTypeId<Ts>())... };
 		}
 
+		template<class T>
+		int fillInitialComponentValue(int firstElementIndex, int count, const T& value, typeId tid)
+		{
+			if (tid->type == ComponentType::Shared || tid->size == 0)
+				return 0;
+			markChanged(layout->getArrayIndex(tid));
+			if (tid->fields.size())
+				setComponentValues(firstElementIndex, count, value, tid);
+			else
+				std::uninitialized_fill_n(getComponent<T>(tid, firstElementIndex), count, value);
+			return 0;
+		}
+
+		// Assigns the value to already constructed components
+		template<class T>
+		void setComponentValues(int firstElementIndex, int count, const T& value, typeId tid)
+		{
+			markChanged(layout->getArrayIndex(tid));
+			if (tid->fields.empty())
+			{
+				std::fill_n(getComponent<T>(tid, firstElementIndex), count, value);
+				return;
+			}
+
+			int arrayIndex = layout->getArrayIndex(tid);
+			for (int i = 0; i < count; i++)
+				scatterElement(arrayIndex, firstElementIndex + i, reinterpret_cast<const uint8_t*>(&value));
+		}
+
+		template<class... Ts>
+		void fillInitialComponentValues(int firstElementIndex, int count, const Ts&... values)
+		{
+			auto tmp = { fillInitialComponentValue(firstElementIndex, count, values, archetype->ecs->getTypeId<Ts>())... };
+		}
+
+		// Value initializes the elements and returns the first one. Empty components have no array, they get a dummy that's shared by every element.
+		template<class T>
+		T* constructComponents(int firstElementIndex, int count, typeId tid)
+		{
+			if constexpr (std::is_empty_v<T>)
+			{
+				static T dummy;
+				return &dummy;
+			}
+			else
+			{
+				markChanged(layout->getArrayIndex(tid));
+				T* elements = getComponent<T>(tid, firstElementIndex);
+				std::uninitialized_value_construct_n(elements, count);
+				return elements;
+			}
+		}
+
 		void save(istream& stream) const
 		{
 			stream.write((char*)&size, sizeof(size));
-			stream.write((char*)&buffer[0], size * sizeof(entityId));
+			stream.write((const char*)getEntityIds(), size * sizeof(entityId));
 
 			int lastIndex = -1;
-			size_t componentTypeCount = componentArrays.size();
-			for (int iComp = 0; iComp < componentTypeCount; iComp++)
+			for (auto& column : layout->arrays)
 			{
-				auto componentArray = componentArrays[iComp].get();
-				if (componentArray->tid->type == ComponentType::State)
+				if (column.tid->type == ComponentType::State || (!column.fieldOffsets.size() && !isSaveable(column.tid)))
 					continue;
-				int componentIndex = componentArray->tid->index;
+				int componentIndex = column.tid->index;
 				stream.write((char*)&componentIndex, sizeof(componentIndex));
-				componentArray->save(stream, size);
+				if (column.fieldOffsets.size())
+				{
+					for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
+						stream.write((const char*)getBuffer() + column.fieldOffsets[iField], size * column.tid->fields[iField].size);
+				}
+				else
+					column.tid->ops.save(stream, getBuffer() + column.offset, size);
 			}
 			stream.write((char*)&lastIndex, sizeof(lastIndex));
 
-			size_t sharedComponentTypeCount = sharedComponents.size();
-			for (int iComp = 0; iComp < sharedComponentTypeCount; iComp++)
+			for (auto& column : layout->sharedComponents)
 			{
-				auto componentArray = sharedComponents[iComp].get();
-				if (componentArray->tid->type == ComponentType::State)
+				if (column.tid->type == ComponentType::State || !isSaveable(column.tid))
 					continue;
-				int componentIndex = componentArray->tid->index;
+				int componentIndex = column.tid->index;
 				stream.write((char*)&componentIndex, sizeof(componentIndex));
-				componentArray->save(stream, 1);
+				column.tid->ops.save(stream, getBuffer() + column.offset, 1);
 			}
 			stream.write((char*)&lastIndex, sizeof(lastIndex));
 		}
 
+		// The chunk must be empty. The components are constructed first, not every component is in the stream.
 		void load(istream& stream, const std::vector<typeId>& typeIdsByLoadedIndex)
 		{
+			_ASSERT(size == 0);
 			stream.read((char*)&size, sizeof(size));
 			stream.read((char*)getEntityIds(), size * sizeof(entityId));
 
+			for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
+			{
+				constructElements(iArray, 0, size);
+			}
+
 			while(true)
 			{
 				int componentIndex;
@@ -421,8 +618,14 @@ namespace ecs
 					break;
 
 				typeId componentTypeId = typeIdsByLoadedIndex[componentIndex];
-				auto componentArray = getArray(componentTypeId);
-				componentArray->load(stream, size);
+				auto& column = layout->arrays[layout->getArrayIndex(componentTypeId)];
+				if (column.fieldOffsets.size())
+				{
+					for (int iField = 0; iField < (int)column.fieldOffsets.size(); iField++)
+						stream.read((char*)getBuffer() + column.fieldOffsets[iField], size * column.tid->fields[iField].size);
+				}
+				else
+					column.tid->ops.load(stream, getBuffer() + column.offset, size);
 			}
 
 			while(true)
@@ -433,17 +636,27 @@ namespace ecs
 					break;
 
 				typeId componentTypeId = typeIdsByLoadedIndex[componentIndex];
-				auto componentArray = getSharedComponentArray(componentTypeId);
-				componentArray->load(stream, 1);
+				auto& column = layout->sharedComponents[layout->getSharedIndex(componentTypeId)];
+				column.tid->ops.load(stream, getBuffer() + column.offset, 1);
 			}
 		}
 
 		void saveElement(istream& stream, int elementIndex) const
 		{
-			for (auto& componentArray : componentArrays)
+			for (int iArray = 0; iArray < (int)layout->arrays.size(); iArray++)
 			{
-				stream.write((char*)&componentArray->tid->index, sizeof(componentArray->tid->index));
-				componentArray->saveElement(stream, elementIndex);
+				auto& column = layout->arrays[iArray];
+				if (!column.fieldOffsets.size() && !isSaveable(column.tid))
+					continue;
+				stream.write((char*)&column.tid->index, sizeof(column.tid->index));
+				if (column.fieldOffsets.size())
+				{	// prefabs store the whole struct
+					std::vector<uint8_t> element = column.tid->defaultValue;
+					gatherElement(iArray, elementIndex, element.data());
+					stream.write((const char*)element.data(), column.tid->size);
+				}
+				else
+					column.tid->ops.save(stream, getBuffer() + column.offset + elementIndex * column.tid->size, 1);
 			}
 			int invalidIndex = -1;
 			stream.write((char*)&invalidIndex, sizeof(invalidIndex));
@@ -460,21 +673,32 @@ namespace ecs
 					break;
 
 				typeId componentTypeId = typeIdsByLoadedIndex[componentIndex];
-				auto componentArray = getArray(componentTypeId);
-				componentArray->loadElement(stream, elementIndex);
+				int arrayIndex = layout->getArrayIndex(componentTypeId);
+				if (componentTypeId->fields.size())
+				{
+					std::vector<uint8_t> element(componentTypeId->size);
+					stream.read((char*)element.data(), componentTypeId->size);
+					scatterElement(arrayIndex, elementIndex, element.data());
+				}
+				else
+				{
+					markChanged(arrayIndex);
+					componentTypeId->ops.load(stream, getElement(arrayIndex, elementIndex), 1);
+				}
 			}
 		}
 
-		static inline const int bufferCapacity = 1 << 14;	// 16k chunks
-
-		alignas(entityId)
-		std::array<uint8_t, bufferCapacity> buffer;
-		std::vector<std::unique_ptr<ComponentArrayBase>> componentArrays;
-		std::vector<std::unique_ptr<ComponentArrayBase>> sharedComponents;
-
 		int size = 0;
-		int entityCapacity;
+		int entityCapacity = 0;
+
+		struct Archetype* archetype = nullptr;
+		const ChunkLayout* layout = nullptr;	// owned by the archetype
+		ChunkAllocator* allocator = nullptr;	// owned by the ecs
+		const uint64_t* changeVersion = nullptr;	// the current change version of the ecs
 
-		struct Archetype* archetype;
+	private:
+		Chunk() = default;
 	};
-}
\ No newline at end of file
+
+	using ChunkPtr = std::unique_ptr<Chunk, Chunk::Deleter>;
+}
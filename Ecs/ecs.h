@@ -1,10 +1,24 @@
 #pragma once
 #include "archetype.h"
+#include "entity_table.h"
 #include <atomic>
 #include <mutex>
 
+namespace ftl
+{
+	class TaskScheduler;
+}
+
 namespace ecs
 {
+	// The entities that got or lost a component since the events were cleared, see Ecs::trackComponentEvents
+	struct ComponentEvents
+	{
+		std::vector<entityId> added;
+		std::vector<entityId> removed;
+		bool sorted = true;	// the lists are sorted and deduplicated when they are read
+	};
+
 	struct Ecs
 	{
 	public:
@@ -27,65 +41,43 @@ namespace ecs
 		template<typename>
 		friend struct EntityCommand_SetSharedComponent;
 
-		template<size_t ComponentCount>
-		struct QueriedChunk
-		{
-			int entityCount;	// this exists in the chunk but for efficiency we copy it out here
-			std::array<uint8_t*, ComponentCount + 1> buffers;
-			Chunk* chunk;
-		};
-
+		// The cached query of a view, created on first use. Its chunk list is kept up to date by the archetypes, so acquiring it is a lookup.
 		template<class ...Ts>
-		std::vector<QueriedChunk<sizeof...(Ts)>> get(const typeQueryList& typeIds)
+		CachedQuery<sizeof...(Ts)>* getCachedQuery(const typeQueryList& query)
 		{
-			std::vector<QueriedChunk<sizeof...(Ts)>> ret;
-			ret.reserve(10);
+			std::array<typeId, sizeof...(Ts)> componentTypeIds = { getTypeId<Ts>()... };
 
-			if constexpr (sizeof...(Ts) > 0)
+			std::lock_guard<std::mutex> lock(cachedQueryMutex_);	// views are created from the system tasks in parallel
+			std::vector<CachedQueryBase*>& candidates = cachedQueriesByRequiredTypes_[query.required];
+			for (CachedQueryBase* candidate : candidates)
 			{
-				typeId typeIdsToGet[] = { getTypeId<Ts>()... };
-				for (auto& archetype : archetypes_)
-				{
-					if (archetype && archetype->hasAllComponents(typeIds))
-					{
-						for (auto& chunk : archetype->chunks)
-						{
-							if (!chunk || chunk->size == 0)
-								continue;
-
-							auto& queriedChunk = ret.emplace_back();
-							queriedChunk.chunk = chunk.get();
-							queriedChunk.entityCount = queriedChunk.chunk->size;
-							queriedChunk.buffers[0] = &queriedChunk.chunk->buffer[0];	// the first buffer is the entity ids
-							for (int i = 0; i < (int)sizeof...(Ts); i++)
-							{
-								_ASSERT_EXPR(typeIdsToGet[i]->type != ComponentType::Shared, L"Use getSharedComponent on the iterator if you want to read a shared component!");
-								_ASSERT_EXPR(typeIdsToGet[i]->size != 0, L"Attempting to read an empty class component! Use the with function on the View.");
-								queriedChunk.buffers[i + 1] = queriedChunk.chunk->getArray(typeIdsToGet[i])->buffer;
-							}
-						}
-					}
-				}
+				if (candidate->matches(query, componentTypeIds.data(), componentTypeIds.size()))
+					return static_cast<CachedQuery<sizeof...(Ts)>*>(candidate);
 			}
-			else
+
+			for (typeId tid : componentTypeIds)
+			{
+				_ASSERT_EXPR(tid->type != ComponentType::Shared, L"Use getSharedComponent on the iterator if you want to read a shared component!");
+				_ASSERT_EXPR(tid->size != 0, L"Attempting to read an empty class component! Use the with function on the View.");
+			}
+
+			auto newQuery = std::make_unique<CachedQuery<sizeof...(Ts)>>(query, std::vector<typeId>(componentTypeIds.begin(), componentTypeIds.end()));
+			for (auto& archetype : archetypes_)
 			{
-				for (auto& archetype : archetypes_)
+				if (archetype && archetype->hasAllComponents(query))
 				{
-					if (archetype && archetype->hasAllComponents(typeIds))
+					archetype->matchingQueries.push_back(newQuery.get());
+					for (auto& chunk : archetype->chunks)
 					{
-						for (auto& chunk : archetype->chunks)
-						{
-							if (!chunk || chunk->size == 0)
-								continue;
-
-							auto& queriedChunk = ret.emplace_back();
-							queriedChunk.chunk = chunk.get();
-							queriedChunk.entityCount = queriedChunk.chunk->size;
-							queriedChunk.buffers[0] = &queriedChunk.chunk->buffer[0];	// the first buffer is the entity ids
-						}
+						if (chunk)
+							newQuery->addChunk(chunk.get());
 					}
 				}
 			}
+
+			CachedQuery<sizeof...(Ts)>* ret = newQuery.get();
+			candidates.push_back(ret);
+			cachedQueries_.emplace_back(std::move(newQuery));
 			return ret;
 		}
 
@@ -147,6 +139,13 @@ namespace ecs
 				return;
 			}
 
+			// the type sets have a bit for maxTypeCount types, a type past that would write out of them
+			if (typeDescriptors_.size() >= (size_t)typeIdList::maxTypeCount)
+			{
+				printf("Component \"%s\" can't be registered, there are already %d types. Raise ECS_MAX_TYPE_COUNT!\n", name, typeIdList::maxTypeCount);
+				return;
+			}
+
 			auto& typeDesc = typeDescriptors_.emplace_back(std::make_unique<TypeDescriptor>());
 			typeDesc->index = (int)typeDescriptors_.size() - 1;
 			if constexpr (std::is_empty_v<T>)
@@ -160,10 +159,62 @@ namespace ecs
 			typeDesc->alignment = alignof(T);
 			typeDesc->type = componentType;
 			typeDesc->name = name;
-			componentArrayFactory_.addFactoryFunction<T>(typeDesc.get());
+			typeDesc->ops = makeComponentOps<T>();
 			typeIds_.push_back(typeDesc.get());
 		}
 
+		// Registers a component that the chunks store as one array per field (structure of arrays), so a loop over one field only touches that field.
+		// Every member has to be listed, e.g. registerSoAType<B>("BComp", &B::b, &B::bf), a component with a missing member isn't registered. The fields are read with View::getFieldSpan.
+		template<class T, class... Fs>
+		void registerSoAType(const char* name, Fs T::*... fields)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable components can be stored field by field");
+			static_assert(sizeof...(Fs) > 0, "List the fields of the component");
+			_ASSERT_EXPR(!getTypeId<T>(), L"The component is already registered!");
+			static const T defaultValue{};
+			const uint8_t* base = reinterpret_cast<const uint8_t*>(&defaultValue);
+			std::vector<FieldDescriptor> fieldList = { FieldDescriptor{ (int)(reinterpret_cast<const uint8_t*>(&(defaultValue.*fields)) - base), (int)sizeof(Fs), (int)alignof(Fs) }... };
+			std::sort(fieldList.begin(), fieldList.end(), [](const FieldDescriptor& lhs, const FieldDescriptor& rhs) { return lhs.offset < rhs.offset; });
+
+			// the unlisted members wouldn't be stored, only the padding before a field and at the end can be left out
+			int coveredEnd = 0;
+			bool coversComponent = true;
+			for (const FieldDescriptor& field : fieldList)
+			{
+				coversComponent = coversComponent && field.offset >= coveredEnd && field.offset - coveredEnd < field.alignment;
+				coveredEnd = field.offset + field.size;
+			}
+			coversComponent = coversComponent && (int)sizeof(T) - coveredEnd < (int)alignof(T);
+			if (!coversComponent)
+			{
+				printf("The fields of component \"%s\" don't cover it, list every member once!\n", name);
+				return;
+			}
+
+			registerType<T>(name);
+			if (!getTypeId<T>())
+				return;		// there is no room for more types
+
+			TypeDescriptor* typeDesc = typeDescriptors_.back().get();
+			typeDesc->fields = std::move(fieldList);
+			typeDesc->defaultValue.assign(base, base + sizeof(T));
+		}
+
+		// The index of a field in the registration of a component stored field by field, -1 if it's not there
+		template<class T, class F>
+		int getFieldIndex(F T::* field) const
+		{
+			static const T probe{};
+			int offset = (int)(reinterpret_cast<const uint8_t*>(&(probe.*field)) - reinterpret_cast<const uint8_t*>(&probe));
+			const std::vector<FieldDescriptor>& fields = getTypeId<T>()->fields;
+			for (int iField = 0; iField < (int)fields.size(); iField++)
+			{
+				if (fields[iField].offset == offset)
+					return iField;
+			}
+			return -1;
+		}
+
 		template<class T>
 		void setComponent(entityId id, const T& value)
 		{
@@ -173,9 +224,13 @@ namespace ecs
 
 			if (componentTypeId->type != ComponentType::Shared)
 			{
-				T* comp = getComponent<T>(id);
-				if (comp)
-					*comp = value;
+				const entityDataIndex* location = entityLocations_.find(id);
+				if (!location)
+					return;
+
+				Chunk* chunk = archetypes_[location->archetypeIndex]->chunks[location->chunkIndex].get();
+				if (chunk->layout->getArrayIndex(componentTypeId) >= 0)
+					chunk->setComponentValues(location->elementIndex, 1, value, componentTypeId);
 			}
 			else
 			{
@@ -186,10 +241,14 @@ namespace ecs
 		template<class T>
 		void setSharedComponent(entityId id, const T& value)
 		{
-			entityDataIndex oldEntityIndex = entityDataIndexMap_[id];
+			entityDataIndex* entityIndex = entityLocations_.find(id);
+			if (!entityIndex)
+				return;
+
+			entityDataIndex oldEntityIndex = *entityIndex;
 			Archetype* archetype = archetypes_[oldEntityIndex.archetypeIndex].get();
 			auto [newEntityIndex, movedId] = archetype->setSharedComponent(oldEntityIndex, value);
-			entityDataIndexMap_[id] = newEntityIndex;
+			*entityIndex = newEntityIndex;
 			if (movedId)
 				setEntityIndexMap(movedId, oldEntityIndex);
 		}
@@ -218,75 +277,159 @@ namespace ecs
 		template<class ...Ts>
 		entityId createEntity(const Ts&... initialValue);
 
+		// Creates count entities with the same initial values. The archetype is resolved once and whole chunks are filled at a time.
+		// A count of zero or less creates nothing, not even the archetype.
+		template<class ...Ts>
+		EntityRange createEntities(int count, const Ts&... initialValue);
+
+		// The generator is called as generator(int indexInRange, Ts&... components) on value initialized components.
+		// Shared components can't be generated per entity, use the other overload for those.
+		template<class ...Ts, class Fn, class = std::enable_if_t<std::is_invocable_v<Fn, int, Ts&...>>>
+		EntityRange createEntities(int count, Fn&& generator);
+
 		// If you call this from the outside, keepStateComponents needs to be true. False is only for internal usage.
 		bool deleteEntity(entityId id, bool keepStateComponents = true);
 
 		template<class T>
 		void addComponent(entityId id, const T& data)
 		{
-			auto it = entityDataIndexMap_.find(id);
-			if (it == entityDataIndexMap_.end())
+			const entityDataIndex* entityIndex = entityLocations_.find(id);
+			if (!entityIndex)
 				return;
 
-			Archetype* oldArchetype = archetypes_[it->second.archetypeIndex].get();
-			typeIdList newTypes = oldArchetype->containedTypes_;
-			newTypes.addTypes({ getTypeId<T>() });
-			changeComponents(id, newTypes);
+			Archetype* oldArchetype = archetypes_[entityIndex->archetypeIndex].get();
+			moveEntity(id, *entityIndex, getArchetypeEdge(oldArchetype, getTypeId<T>(), true));
 			setComponent(id, data);
 		}
 
+		// Adds the component to many entities at once. The entities are grouped by chunk and moved in contiguous runs,
+		// a chunk whose entities are all in the list moves with one relocation per component array.
+		template<class T>
+		void addComponent(const std::vector<entityId>& ids, const T& data);
+
 		void deleteComponents(entityId id, const typeIdList& typeIds);
+		void deleteComponents(const std::vector<entityId>& ids, const typeIdList& typeIds); // batched like addComponent above
 
 		void changeComponents(entityId id, const typeIdList& typeIds);
+		void changeComponents(const std::vector<entityId>& ids, const typeIdList& typeIds); // batched like addComponent above
 
 		template<class... Ts>
 		bool hasAllComponents(entityId id) const
 		{
-			auto it = entityDataIndexMap_.find(id);
-			if (it == entityDataIndexMap_.end())
+			const entityDataIndex* entityIndex = entityLocations_.find(id);
+			if (!entityIndex)
 				return false;
 
 			typeQueryList queryList(typeDescriptors_.size());
 			queryList.add(getTypeIds<Ts...>(), TypeQueryItem::Mode::Read);
-			return archetypes_[it->second.archetypeIndex]->hasAllComponents(queryList);
+			return archetypes_[entityIndex->archetypeIndex]->hasAllComponents(queryList);
 		}
 
 		template<class... Ts>
 		std::array<bool, sizeof...(Ts)> hasEachComponent(entityId id) const
 		{
-			auto it = entityDataIndexMap_.find(id);
-			if (it == entityDataIndexMap_.end())
+			const entityDataIndex* entityIndex = entityLocations_.find(id);
+			if (!entityIndex)
 				return {};
 
-			const Archetype* archetype = archetypes_[it->second.archetypeIndex].get();
+			const Archetype* archetype = archetypes_[entityIndex->archetypeIndex].get();
 			std::array<bool, sizeof...(Ts)> ret = { archetype->containedTypes_.hasType(getTypeId<Ts>())... };
 			return ret;
 		}
 
+		// nullptr if the entity is dead, doesn't have T or T is stored field by field
 		template<class T>
 		T* getComponent(entityId id) const
 		{
-			auto it = entityDataIndexMap_.find(id);
-			if (it == entityDataIndexMap_.end())
+			const entityDataIndex* location = entityLocations_.find(id);
+			if (!location)
 				return nullptr;
 
-			entityDataIndex entityIndex = it->second;
+			entityDataIndex entityIndex = *location;
 			Archetype* archetype = archetypes_[entityIndex.archetypeIndex].get();
 			Chunk* chunk = archetype->chunks[entityIndex.chunkIndex].get();
 			typeId componentTypeId = getTypeId<T>();
 			_ASSERT_EXPR(componentTypeId->type != ComponentType::Shared, L"Use the chunk's getSharedComponent for shared components!");
 			_ASSERT_EXPR(componentTypeId->size != 0, L"Can't use getComponent on empty class components. Use hasComponent instead to check for existence.");
-			ComponentArrayBase* componentArray = chunk->getArray(componentTypeId);
-			if (!componentArray)
-				return nullptr;
-
-			return static_cast<ComponentArray<T>*>(componentArray)->getElement(it->second.elementIndex);
+			return chunk->getComponent<T>(componentTypeId, entityIndex.elementIndex);
 		}
 
 		typeId getTypeIdByName(const std::string& typeName);
 
+		// Pool statistics and huge page settings of the chunk memory
+		ChunkAllocator& getChunkAllocator() { return chunkAllocator_; }
+
+		// Maps the entity ids to their locations, for statistics
+		const EntityLocationTable& getEntityLocations() const { return entityLocations_; }
+
+		// Chunk size of the archetypes created from now on, existing archetypes keep their chunks
+		void setDefaultChunkSize(ChunkSizeClass sizeClass) { defaultChunkSize_ = sizeClass; }
+
+		// Overrides the default for the archetype with exactly these components, set it before the first entity of the archetype is created
+		template<class... Ts>
+		void setChunkSize(ChunkSizeClass sizeClass)
+		{
+			chunkSizeByTypes_[getTypeIds<Ts...>()] = sizeClass;
+		}
+
+		ChunkSizeClass getChunkSize(const typeIdList& typeIds) const
+		{
+			auto it = chunkSizeByTypes_.find(typeIds);
+			return it != chunkSizeByTypes_.end() ? it->second : defaultChunkSize_;
+		}
+
+		// The worker threads of View::parallelForEach, the Scheduler sets its own. Without one the parallel loops run inline.
+		void setTaskScheduler(ftl::TaskScheduler* taskScheduler) { taskScheduler_ = taskScheduler; }
+		ftl::TaskScheduler* getTaskScheduler() const { return taskScheduler_; }
+
+		// Records the entities that get or lose T from now on, View::added and View::removed iterate them.
+		// Scheduler::runSystems clears the events after its systems ran, so the systems of a frame see every change since the previous frame's systems.
+		// Without the scheduler call clearComponentEvents after processing the events.
+		template<class T>
+		void trackComponentEvents()
+		{
+			typeId tid = getTypeId<T>();
+			std::lock_guard<std::mutex> lock(componentEventsMutex_);
+			trackedEventTypes_.addTypes({ tid });
+		}
+
+		template<class T>
+		const std::vector<entityId>& getAddedEntities() { return getComponentEvents(getTypeId<T>()).added; }
+
+		// Includes the deleted entities
+		template<class T>
+		const std::vector<entityId>& getRemovedEntities() { return getComponentEvents(getTypeId<T>()).removed; }
+
+		void clearComponentEvents();
+
+		// Every write to a component array stamps it with the current change version, View::changedSince compares against these.
+		uint64_t getChangeVersion() const { return changeVersion_; }
+
+		// Starts a new change version and returns it. Remember it after processing the changes, the writes from now on are at this version or later.
+		uint64_t advanceChangeVersion() { return ++changeVersion_; }
+
 		void executeCommmandBuffer();
 
+		// Temporary ids are only valid until the command buffer is executed. Their numbering restarts after that.
+		void setTemporaryEntityIdRemapping(entityId temporaryId, entityId id)
+		{
+			size_t index = (size_t)-temporaryId;
+			if (index >= temporaryEntityIdRemapping_.size())
+				temporaryEntityIdRemapping_.resize(index + 1);
+			temporaryEntityIdRemapping_[index] = id;
+		}
+
+		entityId resolveTemporaryEntityId(entityId id) const
+		{
+			if (id >= 0)
+				return id;
+
+			size_t index = (size_t)-id;
+			if (index >= temporaryEntityIdRemapping_.size())
+				return 0;
+			return temporaryEntityIdRemapping_[index];
+		}
+
 private:
 	entityId getTempEntityId()
 	{
@@ -294,6 +437,21 @@ private:
 		return ret;
 	}
 
+	void removeFromArchetype(entityDataIndex entityIndex);
+	// Deletes the archetype if it became empty and updates the location of the entity that took the place of the removed one
+	void onRemovedFromArchetype(entityDataIndex entityIndex, entityId movedEntity);
+
+	// Returns the cached edge of the archetype for adding/removing a component, (re)computing it if it's missing or its destination was deleted
+	const ArchetypeEdge& getArchetypeEdge(Archetype* archetype, typeId tid, bool addType);
+	void makeArchetypeEdge(ArchetypeEdge& edge, Archetype* sourceArchetype, const typeIdList& newTypes);
+	void moveEntity(entityId id, entityDataIndex entityIndex, const ArchetypeEdge& edge);
+	// Adds the entities to the events of the tracked types that are only in one of the lists
+	void recordComponentEvents(const typeIdList& oldTypes, const typeIdList& newTypes, const entityId* ids, int count);
+	const ComponentEvents& getComponentEvents(typeId tid);
+	// getEdge(Archetype* source) returns the edge to follow, onMoved(Chunk*, int firstElementIndex, int count) is called for every moved run at its destination
+	template<class GetEdge, class OnMoved>
+	void moveEntities(const std::vector<entityId>& ids, GetEdge&& getEdge, OnMoved&& onMoved);
+
 	void addToCommandBuffer(std::unique_ptr<struct EntityCommand>&& command)
 	{
 		commandBufferMutex.lock();
@@ -307,14 +465,7 @@ private:
 		typeId componentTypeId = getTypeId<T>();
 		_ASSERT_EXPR(componentTypeId->size != 0, L"Can't use getComponent on empty class components. Use hasComponent instead to check for existence.");
 
-		auto componentArray = chunk->getArray(componentTypeId);
-		if (!componentArray)
-		{
-			out = nullptr;
-			return;
-		}
-
-		out = static_cast<ComponentArray<std::decay_t<T>>*>(componentArray)->getElement(elementIndex);
+		out = chunk->getComponent<std::decay_t<T>>(componentTypeId, elementIndex);
 	}
 
 	template<class T, class... Ts>
@@ -328,38 +479,38 @@ private:
 	{
 		if (!id)
 		{
-			printf("setEntityIndexMap (%d) invalid id to index: %d, %d, %d\n", id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
+			printf("setEntityIndexMap (%lld) invalid id to index: %d, %d, %d\n", (long long)id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
 			return false;
 		}
 
-		if (index.archetypeIndex < 0 || index.archetypeIndex >= archetypes_.size() || !archetypes_[index.archetypeIndex])
+		if (index.archetypeIndex < 0 || index.archetypeIndex >= (int)archetypes_.size() || !archetypes_[index.archetypeIndex])
 		{
-			printf("setEntityIndexMap (%d) invalid archetypeIndex: %d, %d, %d\n", id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
+			printf("setEntityIndexMap (%lld) invalid archetypeIndex: %d, %d, %d\n", (long long)id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
 			return false;
 		}
 
 		auto arch = archetypes_[index.archetypeIndex].get();
-		if (index.chunkIndex < 0 || index.chunkIndex >= arch->chunks.size() || !arch->chunks[index.chunkIndex])
+		if (index.chunkIndex < 0 || index.chunkIndex >= (int)arch->chunks.size() || !arch->chunks[index.chunkIndex])
 		{
-			printf("setEntityIndexMap (%d) invalid chunkIndex: %d, %d, %d\n", id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
+			printf("setEntityIndexMap (%lld) invalid chunkIndex: %d, %d, %d\n", (long long)id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
 			return false;
 		}
 
 		auto chunk = arch->chunks[index.chunkIndex].get();
 		if (index.elementIndex < 0 || index.elementIndex >= chunk->size)
 		{
-			printf("setEntityIndexMap (%d) invalid elementIndex: %d, %d, %d\n", id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
+			printf("setEntityIndexMap (%lld) invalid elementIndex: %d, %d, %d\n", (long long)id, index.archetypeIndex, index.chunkIndex, index.elementIndex);
 			return false;
 		}
 
-		entityId actualId = reinterpret_cast<entityId*>(&chunk->buffer[0])[index.elementIndex];
+		entityId actualId = chunk->getEntityIds()[index.elementIndex];
 		if (actualId != id)
 		{
-			printf("setEntityIndexMap (%d) actual id at the place is %d: %d, %d, %d\n", id, actualId, index.archetypeIndex, index.chunkIndex, index.elementIndex);
+			printf("setEntityIndexMap (%lld) actual id at the place is %lld: %d, %d, %d\n", (long long)id, (long long)actualId, index.archetypeIndex, index.chunkIndex, index.elementIndex);
 			return false;
 		}
 
-		entityDataIndexMap_[id] = index;
+		entityLocations_.set(id, index);
 		return true;
 	}
 
@@ -372,15 +523,15 @@ public:
 		template<class... Ts>
 		std::tuple<Ts*...> getComponents(entityId id)
 		{
-			auto it = entityDataIndexMap_.find(id);
-			if (it == entityDataIndexMap_.end())
+			const entityDataIndex* entityIndex = entityLocations_.find(id);
+			if (!entityIndex)
 				return std::tuple<Ts *...>{};
 
-			Archetype* archetype = archetypes_[it->second.archetypeIndex].get();
-			Chunk* chunk = archetype->chunks[it->second.chunkIndex].get();
+			Archetype* archetype = archetypes_[entityIndex->archetypeIndex].get();
+			Chunk* chunk = archetype->chunks[entityIndex->chunkIndex].get();
 
 			std::tuple<Ts*...> ret = {};
-			std::apply([&](auto& ...x) { getComponents_impl(chunk, it->second.elementIndex, x...); }, ret);
+			std::apply([&](auto& ...x) { getComponents_impl(chunk, entityIndex->elementIndex, x...); }, ret);
 			return ret;
 		}
 
@@ -393,20 +544,33 @@ public:
 		void save(istream& stream) const;
 		void load(istream& stream);
 
-		ComponentArrayFactory componentArrayFactory_;
 		std::vector<std::unique_ptr<TypeDescriptor>> typeDescriptors_;	// we store pointers so the raw TypeDescriptor* will stay stable for sure
 		std::vector<typeId> typeIds_;	// This is the same as the typedescriptors but has no ownership. I didn't want the api to have unique_ptr all over the place
-		std::unordered_map<entityId, entityDataIndex> entityDataIndexMap_;
+		EntityLocationTable entityLocations_;
+		ChunkAllocator chunkAllocator_;	// has to outlive the archetypes
 		std::vector<std::unique_ptr<Archetype>> archetypes_;
+		std::unordered_map<typeIdList, int, typeIdListHash> archetypeIndexByTypes_;
+		std::vector<int> freeArchetypeIndices_;	// can contain indices that were popped from the end of archetypes_ since, check before use
+		uint64_t lastArchetypeSerial_ = 0;
+		ChunkSizeClass defaultChunkSize_ = ChunkSizeClass::Size16K;
+		std::unordered_map<typeIdList, ChunkSizeClass, typeIdListHash> chunkSizeByTypes_;
+		uint64_t changeVersion_ = 1;	// 0 is older than any write
+		typeIdList trackedEventTypes_ = typeIdList(0, {});
+		std::array<ComponentEvents, typeIdList::maxTypeCount> componentEvents_;	// indexed by the type index, never moves so the event ranges can point into it
+		std::mutex componentEventsMutex_;
+		std::vector<std::unique_ptr<CachedQueryBase>> cachedQueries_;
+		std::unordered_map<typeIdList, std::vector<CachedQueryBase*>, typeIdListHash> cachedQueriesByRequiredTypes_;
+		std::mutex cachedQueryMutex_;
+		ftl::TaskScheduler* taskScheduler_ = nullptr;
 		std::vector<std::unique_ptr<struct EntityCommand>> entityCommandBuffer_;
-		std::unordered_map<entityId, entityId> temporaryEntityIdRemapping_;		// for EntityCommand_Create
+		std::vector<entityId> temporaryEntityIdRemapping_;		// for EntityCommand_Create, indexed by the negated temporary id
 		
 		std::mutex commandBufferMutex;
 
+		std::mutex typeLockMutex_;	// the system tasks lock their types concurrently
 		std::vector<typeId> lockedForRead;
 		std::vector<typeId> lockedForWrite;
 
-		entityId nextEntityId = 1;
 		std::atomic<entityId> nextTempEntityId = 1;
 	};
 }
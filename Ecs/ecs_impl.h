@@ -12,43 +12,50 @@ namespace ecs
 	
 	std::tuple<int, Archetype*> Ecs::createArchetype(const typeIdList& typeIds)
 	{
-		int i = 0;
-		int firstEmptyIndex = -1;
-		for (auto& itArchetype : archetypes_)
+		auto it = archetypeIndexByTypes_.find(typeIds);
+		if (it != archetypeIndexByTypes_.end())
+			return { it->second, archetypes_[it->second].get() };
+
+		int newIndex = -1;
+		while (freeArchetypeIndices_.size())
 		{
-			if (itArchetype)
-			{
-				if (itArchetype->containedTypes_ == typeIds)
-				{
-					return { i, itArchetype.get() };
-				}
-			}
-			else if(firstEmptyIndex < 0)
+			int freeIndex = freeArchetypeIndices_.back();
+			freeArchetypeIndices_.pop_back();
+			if (freeIndex < (int)archetypes_.size() && !archetypes_[freeIndex])
 			{
-				firstEmptyIndex = i;
+				newIndex = freeIndex;
+				break;
 			}
-			i++;
 		}
 
-		if (firstEmptyIndex >= 0)
+		if (newIndex >= 0)
 		{
-			archetypes_[firstEmptyIndex] = std::make_unique<Archetype>(typeIds, firstEmptyIndex, this);
-			return { firstEmptyIndex, archetypes_[firstEmptyIndex].get() };
+			archetypes_[newIndex] = std::make_unique<Archetype>(typeIds, newIndex, this);
 		}
 		else
 		{
-			auto& insertedItem = archetypes_.emplace_back(std::make_unique<Archetype>(typeIds, i, this));
-			return { i, insertedItem.get() };
+			newIndex = (int)archetypes_.size();
+			archetypes_.emplace_back(std::make_unique<Archetype>(typeIds, newIndex, this));
 		}
 
+		Archetype* newArchetype = archetypes_[newIndex].get();
+		for (auto& query : cachedQueries_)
+		{
+			if (newArchetype->hasAllComponents(query->query))
+				newArchetype->matchingQueries.push_back(query.get());
+		}
+
+		archetypeIndexByTypes_.emplace(typeIds, newIndex);
+		return { newIndex, newArchetype };
 	}
 	
 	entityId Ecs::createEntity_impl(const typeIdList& typeIds)
 	{
-		entityId newEntityId = nextEntityId++;
+		entityId newEntityId = entityLocations_.create();
 		auto [archIndex, archetype] = createArchetype(typeIds);
 		entityDataIndex newIndex = archetype->createEntity(newEntityId);
 		setEntityIndexMap(newEntityId, newIndex);
+		recordComponentEvents(getTypeIds<>(), typeIds, &newEntityId, 1);
 		return newEntityId;
 	}
 
@@ -73,7 +80,7 @@ namespace ecs
 	entityId Ecs::createEntity(const Ts&... initialValue)
 	{
 		//EASY_FUNCTION();
-		entityId newEntityId = nextEntityId++;
+		entityId newEntityId = entityLocations_.create();
 		typeIdList typeIds = getTypeIds<Ts...>();
 		auto [archIndex, archetype] = createArchetype(typeIds);
 		entityDataIndex newIndex = archetype->allocateEntity(createSharedComponentDataList(initialValue...));
@@ -81,17 +88,94 @@ namespace ecs
 		chunk->getEntityIds()[newIndex.elementIndex] = newEntityId;
 		chunk->setInitialComponentValues(newIndex.elementIndex, initialValue...);
 		setEntityIndexMap(newEntityId, newIndex);
+		recordComponentEvents(getTypeIds<>(), typeIds, &newEntityId, 1);
 		return newEntityId;
 	}
 
+	template<class ...Ts>
+	EntityRange Ecs::createEntities(int count, const Ts&... initialValue)
+	{
+		if (count <= 0)
+			return {};
+
+		typeIdList typeIds = getTypeIds<Ts...>();
+		auto [archIndex, archetype] = createArchetype(typeIds);
+		tempList<ComponentData> sharedComponentDatas = createSharedComponentDataList(initialValue...);
+		EntityRange ret = entityLocations_.createRange(count);
+
+		int createdCount = 0;
+		while (createdCount < count)
+		{
+			auto [chunk, chunkIndex] = archetype->getOrCreateChunkForNewEntity(sharedComponentDatas);
+			int firstElementIndex = chunk->size;
+			int batchCount = std::min(count - createdCount, chunk->entityCapacity - chunk->size);
+			chunk->size += batchCount;
+
+			entityId* entityIds = chunk->getEntityIds();
+			for (int i = 0; i < batchCount; i++)
+			{
+				entityId newEntityId = ret[createdCount + i];
+				entityIds[firstElementIndex + i] = newEntityId;
+				entityLocations_.set(newEntityId, { archIndex, chunkIndex, firstElementIndex + i });
+			}
+			chunk->fillInitialComponentValues(firstElementIndex, batchCount, initialValue...);
+			recordComponentEvents(getTypeIds<>(), typeIds, entityIds + firstElementIndex, batchCount);
+			createdCount += batchCount;
+		}
+		return ret;
+	}
+
+	template<class ...Ts, class Fn, class>
+	EntityRange Ecs::createEntities(int count, Fn&& generator)
+	{
+		if (count <= 0)
+			return {};
+
+		typeId componentTypeIds[] = { getTypeId<Ts>()... };
+		for (typeId tid : componentTypeIds)
+		{
+			_ASSERT_EXPR(tid->type != ComponentType::Shared, L"Shared components can't be generated per entity. Use createEntities with initial values.");
+		}
+
+		typeIdList typeIds = getTypeIds<Ts...>();
+		auto [archIndex, archetype] = createArchetype(typeIds);
+		EntityRange ret = entityLocations_.createRange(count);
+
+		int createdCount = 0;
+		while (createdCount < count)
+		{
+			auto [chunk, chunkIndex] = archetype->getOrCreateChunkForNewEntity(tempList<ComponentData>{});
+			int firstElementIndex = chunk->size;
+			int batchCount = std::min(count - createdCount, chunk->entityCapacity - chunk->size);
+			chunk->size += batchCount;
+
+			entityId* entityIds = chunk->getEntityIds();
+			for (int i = 0; i < batchCount; i++)
+			{
+				entityId newEntityId = ret[createdCount + i];
+				entityIds[firstElementIndex + i] = newEntityId;
+				entityLocations_.set(newEntityId, { archIndex, chunkIndex, firstElementIndex + i });
+			}
+
+			std::tuple<Ts*...> components = { chunk->constructComponents<Ts>(firstElementIndex, batchCount, getTypeId<Ts>())... };
+			for (int i = 0; i < batchCount; i++)
+			{
+				generator(createdCount + i, std::get<Ts*>(components)[std::is_empty_v<Ts> ? 0 : i]...);
+			}
+			recordComponentEvents(getTypeIds<>(), typeIds, entityIds + firstElementIndex, batchCount);
+			createdCount += batchCount;
+		}
+		return ret;
+	}
+
 	// If you call this from the outside, keepStateComponents needs to be true. False is only for internal usage.
 	bool Ecs::deleteEntity(entityId id, bool keepStateComponents)
 	{
-		auto it = entityDataIndexMap_.find(id);
-		if (it == entityDataIndexMap_.end())
+		const entityDataIndex* location = entityLocations_.find(id);
+		if (!location)
 			return false;
 
-		entityDataIndex entityIndex = it->second;
+		entityDataIndex entityIndex = *location;
 		if (entityIndex.archetypeIndex < 0)
 			return false;
 
@@ -101,7 +185,7 @@ namespace ecs
 		{
 			// Check if the archetype had State type components
 			// If it did, don't actually delete the entity. Keep the state components.
-			for (auto typeDesc : arch->containedTypes_.calcTypeIds(typeIds_))
+			for (auto typeDesc : arch->layout.typeIds)
 			{
 				if (typeDesc->type == ComponentType::State)
 				{
@@ -114,43 +198,269 @@ namespace ecs
 		}
 
 		// Delete the entity and clean up the map indices
-		entityId movedEntity = arch->deleteEntity(entityIndex);
-
-		//entityDataIndex deletedIndex = entityIndex;
-		//deletedIndex.archetypeIndex = -(entityIndex.archetypeIndex + 1);
-		//if (keepStateComponents)
-		//	deletedIndex.chunkIndex = -(entityIndex.chunkIndex + 1);
-		//entityDataIndexMap_[id] = deletedIndex;
+		recordComponentEvents(arch->containedTypes_, getTypeIds<>(), &id, 1);
+		removeFromArchetype(entityIndex);
+		entityLocations_.release(id);
+		return true;
+	}
 
-		entityDataIndexMap_.erase(id);
+	// Removes the entity data but keeps the id alive
+	void Ecs::removeFromArchetype(entityDataIndex entityIndex)
+	{
+		Archetype* arch = archetypes_[entityIndex.archetypeIndex].get();
+		onRemovedFromArchetype(entityIndex, arch->deleteEntity(entityIndex));
+	}
 
-		if (arch->chunks.size() == 0)
+	void Ecs::onRemovedFromArchetype(entityDataIndex entityIndex, entityId movedEntity)
+	{
+		if (archetypes_[entityIndex.archetypeIndex]->chunks.size() == 0)
 			deleteArchetype(entityIndex.archetypeIndex);
 
 		if (movedEntity)
 			setEntityIndexMap(movedEntity, entityIndex);
-		return true;
 	}
 	
 	void Ecs::deleteComponents(entityId id, const typeIdList& typeIds)
 	{
-		auto it = entityDataIndexMap_.find(id);
-		if (it == entityDataIndexMap_.end())
+		const entityDataIndex* entityIndex = entityLocations_.find(id);
+		if (!entityIndex)
 			return;
 
-		Archetype* oldArchetype = archetypes_[it->second.archetypeIndex].get();
+		Archetype* oldArchetype = archetypes_[entityIndex->archetypeIndex].get();
+		if (typeIds.calcTypeCount() == 1)
+		{
+			moveEntity(id, *entityIndex, getArchetypeEdge(oldArchetype, typeIds.calcTypeIds(typeIds_)[0], false));
+			return;
+		}
+
 		typeIdList remainingTypes = oldArchetype->containedTypes_;
 		remainingTypes.deleteTypes(typeIds);
 		changeComponents(id, remainingTypes);
 	}
+
+	const ArchetypeEdge& Ecs::getArchetypeEdge(Archetype* archetype, typeId tid, bool addType)
+	{
+		ArchetypeEdge& edge = addType ? archetype->addEdges[tid] : archetype->removeEdges[tid];
+		if (edge.deletesEntity)
+			return edge;
+
+		if (edge.archetypeIndex >= 0 && edge.archetypeIndex < (int)archetypes_.size())
+		{
+			Archetype* cachedArchetype = archetypes_[edge.archetypeIndex].get();
+			if (cachedArchetype && cachedArchetype->serial == edge.archetypeSerial)
+				return edge;
+		}
+
+		typeIdList newTypes = archetype->containedTypes_;
+		if (addType)
+			newTypes.addTypes({ tid });
+		else
+			newTypes.deleteTypes({ tid });
+
+		makeArchetypeEdge(edge, archetype, newTypes);
+		return edge;
+	}
+
+	void Ecs::makeArchetypeEdge(ArchetypeEdge& edge, Archetype* sourceArchetype, const typeIdList& newTypes)
+	{
+		size_t typeCount = newTypes.calcTypeCount();
+		if (typeCount == 0 ||
+			(typeCount == 1 && newTypes.hasType(getTypeId<DeletedEntity>())))
+		{	// same as in changeComponents
+			edge.deletesEntity = true;
+			return;
+		}
+
+		auto [newArchetypeIndex, newArchetype] = createArchetype(newTypes);
+		edge.deletesEntity = false;
+		edge.archetypeIndex = newArchetypeIndex;
+		edge.archetypeSerial = newArchetype->serial;
+
+		edge.sourceArrayIndices.clear();
+		for (auto& column : newArchetype->layout.arrays)
+			edge.sourceArrayIndices.push_back(sourceArchetype->layout.getArrayIndex(column.tid));
+
+		edge.droppedSourceArrayIndices.clear();
+		for (int iArray = 0; iArray < (int)sourceArchetype->layout.arrays.size(); iArray++)
+		{
+			if (newArchetype->layout.getArrayIndex(sourceArchetype->layout.arrays[iArray].tid) < 0)
+				edge.droppedSourceArrayIndices.push_back(iArray);
+		}
+	}
+
+	void Ecs::moveEntity(entityId id, entityDataIndex entityIndex, const ArchetypeEdge& edge)
+	{
+		if (edge.deletesEntity)
+		{
+			deleteEntity(id, false);
+			return;
+		}
+
+		if (edge.archetypeIndex == entityIndex.archetypeIndex)
+			return;
+
+		recordComponentEvents(archetypes_[entityIndex.archetypeIndex]->containedTypes_, archetypes_[edge.archetypeIndex]->containedTypes_, &id, 1);
+
+		// The edge lives in the source archetype, which gets deleted by onRemovedFromArchetype if this was its last entity
+		auto [newElementIndex, movedEntity] = archetypes_[edge.archetypeIndex]->moveFromEntity(entityIndex, edge);
+		onRemovedFromArchetype(entityIndex, movedEntity);
+		setEntityIndexMap(id, newElementIndex);
+	}
 	
+	void Ecs::deleteComponents(const std::vector<entityId>& ids, const typeIdList& typeIds)
+	{
+		if (typeIds.calcTypeCount() == 1)
+		{
+			typeId tid = typeIds.calcTypeIds(typeIds_)[0];
+			moveEntities(ids, [&](Archetype* sourceArchetype) -> const ArchetypeEdge& { return getArchetypeEdge(sourceArchetype, tid, false); },
+				[](Chunk*, int, int) {});
+			return;
+		}
+
+		ArchetypeEdge edge;
+		uint64_t edgeSourceSerial = 0;
+		moveEntities(ids, [&](Archetype* sourceArchetype) -> const ArchetypeEdge& {
+				if (sourceArchetype->serial != edgeSourceSerial)
+				{
+					typeIdList remainingTypes = sourceArchetype->containedTypes_;
+					remainingTypes.deleteTypes(typeIds);
+					makeArchetypeEdge(edge, sourceArchetype, remainingTypes);
+					edgeSourceSerial = sourceArchetype->serial;
+				}
+				return edge;
+			},
+			[](Chunk*, int, int) {});
+	}
+
+	void Ecs::changeComponents(const std::vector<entityId>& ids, const typeIdList& typeIds)
+	{
+		ArchetypeEdge edge;
+		uint64_t edgeSourceSerial = 0;
+		moveEntities(ids, [&](Archetype* sourceArchetype) -> const ArchetypeEdge& {
+				if (sourceArchetype->serial != edgeSourceSerial)
+				{
+					makeArchetypeEdge(edge, sourceArchetype, typeIds);
+					edgeSourceSerial = sourceArchetype->serial;
+				}
+				return edge;
+			},
+			[](Chunk*, int, int) {});
+	}
+
+	template<class T>
+	void Ecs::addComponent(const std::vector<entityId>& ids, const T& data)
+	{
+		typeId tid = getTypeId<T>();
+		if (tid->type == ComponentType::Shared)
+		{	// the value decides the destination chunk, there are no runs to move together
+			for (entityId id : ids)
+				addComponent(id, data);
+			return;
+		}
+
+		moveEntities(ids, [&](Archetype* sourceArchetype) -> const ArchetypeEdge& { return getArchetypeEdge(sourceArchetype, tid, true); },
+			[&](Chunk* chunk, int firstElementIndex, int count) {
+				if constexpr (!std::is_empty_v<T>)
+					chunk->setComponentValues(firstElementIndex, count, data, tid);
+			});
+	}
+
+	template<class GetEdge, class OnMoved>
+	void Ecs::moveEntities(const std::vector<entityId>& ids, GetEdge&& getEdge, OnMoved&& onMoved)
+	{
+		std::vector<entityDataIndex> locations;
+		locations.reserve(ids.size());
+		for (entityId id : ids)
+		{
+			const entityDataIndex* location = entityLocations_.find(id);
+			if (location)
+				locations.push_back(*location);
+		}
+
+		// Highest element first inside every chunk, so removing a run never moves an entity we still have to process
+		std::sort(locations.begin(), locations.end(), [](const entityDataIndex& a, const entityDataIndex& b)
+			{
+				if (a.archetypeIndex != b.archetypeIndex)
+					return a.archetypeIndex < b.archetypeIndex;
+				if (a.chunkIndex != b.chunkIndex)
+					return a.chunkIndex > b.chunkIndex;
+				return a.elementIndex > b.elementIndex;
+			});
+		locations.erase(std::unique(locations.begin(), locations.end(), [](const entityDataIndex& a, const entityDataIndex& b)
+			{
+				return a.archetypeIndex == b.archetypeIndex && a.chunkIndex == b.chunkIndex && a.elementIndex == b.elementIndex;
+			}), locations.end());
+
+		size_t iLocation = 0;
+		while (iLocation < locations.size())
+		{
+			// Collect a run of consecutive elements in the same chunk
+			size_t iRunEnd = iLocation + 1;
+			while (iRunEnd < locations.size() &&
+				locations[iRunEnd].archetypeIndex == locations[iLocation].archetypeIndex &&
+				locations[iRunEnd].chunkIndex == locations[iLocation].chunkIndex &&
+				locations[iRunEnd].elementIndex == locations[iRunEnd - 1].elementIndex - 1)
+			{
+				iRunEnd++;
+			}
+
+			entityDataIndex first = locations[iRunEnd - 1];
+			int count = int(iRunEnd - iLocation);
+			iLocation = iRunEnd;
+
+			Archetype* sourceArchetype = archetypes_[first.archetypeIndex].get();
+			Chunk* sourceChunk = sourceArchetype->chunks[first.chunkIndex].get();
+			const ArchetypeEdge& edge = getEdge(sourceArchetype);
+
+			if (edge.deletesEntity)
+			{	// the chunk and the archetype can get deleted with the last entity, copy the ids first
+				std::vector<entityId> runIds(sourceChunk->getEntityIds() + first.elementIndex, sourceChunk->getEntityIds() + first.elementIndex + count);
+				for (int i = count - 1; i >= 0; i--)
+					deleteEntity(runIds[i], false);
+				continue;
+			}
+
+			if (edge.archetypeIndex == first.archetypeIndex)
+			{
+				onMoved(sourceChunk, first.elementIndex, count);
+				continue;
+			}
+
+			Archetype* destArchetype = archetypes_[edge.archetypeIndex].get();
+			int movedCount = 0;
+			while (movedCount < count)
+			{
+				auto [destChunk, destChunkIndex] = destArchetype->getOrCreateChunkForMovedEntity(first);
+				int batchCount = std::min(count - movedCount, destChunk->entityCapacity - destChunk->size);
+				int destFirstElementIndex = destChunk->moveEntitiesFromOtherChunk(sourceChunk, first.elementIndex + movedCount, batchCount, edge.sourceArrayIndices, edge.droppedSourceArrayIndices);
+
+				const entityId* destEntityIds = destChunk->getEntityIds();
+				for (int i = 0; i < batchCount; i++)
+					entityLocations_.set(destEntityIds[destFirstElementIndex + i], { edge.archetypeIndex, destChunkIndex, destFirstElementIndex + i });
+				recordComponentEvents(sourceArchetype->containedTypes_, destArchetype->containedTypes_, destEntityIds + destFirstElementIndex, batchCount);
+
+				onMoved(destChunk, destFirstElementIndex, batchCount);
+				movedCount += batchCount;
+			}
+
+			// The edge can live in the source archetype, don't use it after this
+			int fillCount = sourceArchetype->removeDeadEntities(first, count);
+			const entityId* sourceEntityIds = fillCount ? sourceChunk->getEntityIds() : nullptr;
+			for (int i = 0; i < fillCount; i++)
+				entityLocations_.set(sourceEntityIds[first.elementIndex + i], { first.archetypeIndex, first.chunkIndex, first.elementIndex + i });
+
+			if (sourceArchetype->chunks.size() == 0)
+				deleteArchetype(first.archetypeIndex);
+		}
+	}
+
 	void Ecs::changeComponents(entityId id, const typeIdList& typeIds)
 	{
-		auto it = entityDataIndexMap_.find(id);
-		if (it == entityDataIndexMap_.end())
+		const entityDataIndex* entityIndex = entityLocations_.find(id);
+		if (!entityIndex)
 			return;
 
-		Archetype* oldArchetype = archetypes_[it->second.archetypeIndex].get();
+		Archetype* oldArchetype = archetypes_[entityIndex->archetypeIndex].get();
 		auto newTypes = typeIds;
 
 		size_t typeCount = newTypes.calcTypeCount();
@@ -165,8 +475,10 @@ namespace ecs
 		if (archetype == oldArchetype)
 			return;
 
-		entityDataIndex newElementIndex = archetype->moveFromEntity(id, it->second);
-		deleteEntity(id, false);
+		recordComponentEvents(oldArchetype->containedTypes_, archetype->containedTypes_, &id, 1);
+		entityDataIndex oldElementIndex = *entityIndex;
+		auto [newElementIndex, movedEntity] = archetype->moveFromEntity(oldElementIndex);
+		onRemovedFromArchetype(oldElementIndex, movedEntity);
 		setEntityIndexMap(id, newElementIndex);
 	}
 	
@@ -185,7 +497,9 @@ namespace ecs
 
 	void Ecs::deleteArchetype(int archetypeIndex)
 	{
+		archetypeIndexByTypes_.erase(archetypes_[archetypeIndex]->containedTypes_);
 		archetypes_[archetypeIndex].reset();
+		freeArchetypeIndices_.push_back(archetypeIndex);
 
 		while (archetypes_.size() && !archetypes_.back())
 			archetypes_.pop_back();
@@ -201,10 +515,65 @@ namespace ecs
 		}
 		entityCommandBuffer_.clear();
 		temporaryEntityIdRemapping_.clear();
+		nextTempEntityId = 1;
 	}
 	
+	void Ecs::clearComponentEvents()
+	{
+		std::lock_guard<std::mutex> lock(componentEventsMutex_);
+		trackedEventTypes_.forEachTypeIndex([&](int typeIndex)
+			{
+				ComponentEvents& events = componentEvents_[typeIndex];
+				events.added.clear();
+				events.removed.clear();
+				events.sorted = true;
+			});
+	}
+
+	void Ecs::recordComponentEvents(const typeIdList& oldTypes, const typeIdList& newTypes, const entityId* ids, int count)
+	{
+		if (trackedEventTypes_.isEmpty())
+			return;
+
+		std::lock_guard<std::mutex> lock(componentEventsMutex_);	// the views of the system tasks read the events in parallel
+		typeIdList addedTypes = newTypes;
+		addedTypes.deleteTypes(oldTypes);
+		addedTypes.intersectTypes(trackedEventTypes_);
+		addedTypes.forEachTypeIndex([&](int typeIndex)
+			{
+				ComponentEvents& events = componentEvents_[typeIndex];
+				events.added.insert(events.added.end(), ids, ids + count);
+				events.sorted = false;
+			});
+
+		typeIdList removedTypes = oldTypes;
+		removedTypes.deleteTypes(newTypes);
+		removedTypes.intersectTypes(trackedEventTypes_);
+		removedTypes.forEachTypeIndex([&](int typeIndex)
+			{
+				ComponentEvents& events = componentEvents_[typeIndex];
+				events.removed.insert(events.removed.end(), ids, ids + count);
+				events.sorted = false;
+			});
+	}
+
+	const ComponentEvents& Ecs::getComponentEvents(typeId tid)
+	{
+		_ASSERT_EXPR(trackedEventTypes_.hasType(tid), L"Call trackComponentEvents for the component first!");
+		std::lock_guard<std::mutex> lock(componentEventsMutex_);	// views are created from the system tasks in parallel
+		ComponentEvents& events = componentEvents_[tid->index];
+		if (!events.sorted)
+		{
+			makeVectorUniqueAndSorted(events.added);
+			makeVectorUniqueAndSorted(events.removed);
+			events.sorted = true;
+		}
+		return events;
+	}
+
 	bool Ecs::lockTypeForRead(typeId t)
 	{
+		std::lock_guard<std::mutex> lock(typeLockMutex_);
 		if (auto it = std::find(lockedForWrite.begin(), lockedForWrite.end(), t); it != lockedForWrite.end())
 			return false;
 
@@ -214,6 +583,7 @@ namespace ecs
 
 	bool Ecs::lockTypeForWrite(typeId t)
 	{
+		std::lock_guard<std::mutex> lock(typeLockMutex_);
 		if (auto it = std::find(lockedForWrite.begin(), lockedForWrite.end(), t); it != lockedForWrite.end())
 			return false;
 
@@ -226,6 +596,7 @@ namespace ecs
 
 	void Ecs::releaseTypeForRead(typeId t)
 	{
+		std::lock_guard<std::mutex> lock(typeLockMutex_);
 		auto it = std::find(lockedForRead.begin(), lockedForRead.end(), t);
 		if (it != lockedForRead.end())
 			lockedForRead.erase(it);
@@ -235,6 +606,7 @@ namespace ecs
 
 	void Ecs::releaseTypeForWrite(typeId t)
 	{
+		std::lock_guard<std::mutex> lock(typeLockMutex_);
 		auto it = std::find(lockedForWrite.begin(), lockedForWrite.end(), t);
 		if (it != lockedForWrite.end())
 			lockedForWrite.erase(it);
@@ -244,8 +616,8 @@ namespace ecs
 
 	void Ecs::savePrefab(istream& stream, entityId id) const
 	{
-		auto it = entityDataIndexMap_.find(id);
-		if (it == entityDataIndexMap_.end())
+		const entityDataIndex* entityIndex = entityLocations_.find(id);
+		if (!entityIndex)
 			return;
 
 		size_t count = typeDescriptors_.size();
@@ -258,11 +630,11 @@ namespace ecs
 			stream.write(t->name.data(), count);
 		}
 
-	 	auto archetype = archetypes_[it->second.archetypeIndex].get();
+	 	auto archetype = archetypes_[entityIndex->archetypeIndex].get();
 		auto typeList = archetype->containedTypes_.createTypeListWithOnlySavedComponents(typeIds_);
 		typeList.save(stream);
 
-		archetype->savePrefab(stream, it->second);
+		archetype->savePrefab(stream, *entityIndex);
 	}
 
 	entityId Ecs::createEntityFromPrefabStream(istream& stream)
@@ -286,10 +658,11 @@ namespace ecs
 		typeIdList loadedTypeIds = getTypeIds<>();
 		loadedTypeIds.load(stream, typeIdsByLoadedIndex);
 
-		entityId newEntityId = nextEntityId++;
+		entityId newEntityId = entityLocations_.create();
 		auto [archIndex, archetype] = createArchetype(loadedTypeIds);
 		entityDataIndex newIndex = archetype->createEntityFromStream(stream, typeIdsByLoadedIndex, newEntityId);
 		setEntityIndexMap(newEntityId, newIndex);
+		recordComponentEvents(getTypeIds<>(), loadedTypeIds, &newEntityId, 1);
 		return newEntityId;
 	}
 
@@ -332,12 +705,11 @@ namespace ecs
 		}
 
 		// Collect all archetypes that are equivalent even after disregarding state components
-		auto entityMapCopy = std::unordered_map<entityId, entityDataIndex>();
+		EntityLocationTable entityMapCopy;
 
 		int archetypeIndex = 0;
 		std::vector<uint8_t> skipArchetype(archetypes_.size());
 		typeId dontSaveEntityType = getTypeId<DontSaveEntity>();
-		typeId deletedEntity = getTypeId<DeletedEntity>();
 
 		for (size_t iArch = 0; iArch < archetypes_.size(); iArch++)
 		{
@@ -383,10 +755,7 @@ namespace ecs
 					for (int iEntity = 0; iEntity < chunk->size; iEntity++)
 					{
 						auto entity = entityIds[iEntity];
-						auto& entityMapEntry = entityMapCopy[entity];
-						entityMapEntry.archetypeIndex = archetypeIndex;
-						entityMapEntry.chunkIndex = chunkIndex;
-						entityMapEntry.elementIndex = iEntity;
+						entityMapCopy.set(entity, { archetypeIndex, chunkIndex, iEntity });
 					}
 					chunkIndex++;
 				}
@@ -418,23 +787,27 @@ namespace ecs
 		count = 0;
 		stream.write((char*)&count, sizeof(size_t));
 
+		entityLocations_.saveGenerations(stream);
+
 		count = entityMapCopy.size();
 		stream.write((char*)&count, sizeof(size_t));
-		for (auto& it : entityMapCopy)
+		entityMapCopy.forEach([&](entityId entity, const entityDataIndex& dataIndex)
 		{
-			stream.write((const char*)&it.first, sizeof(it.first));
-			stream.write((char*)&it.second, sizeof(it.second));
-		}
-
-		stream.write((char*)&nextEntityId, sizeof(nextEntityId));
+			stream.write((const char*)&entity, sizeof(entity));
+			stream.write((const char*)&dataIndex, sizeof(dataIndex));
+		});
 	}
 	
 	void Ecs::load(istream& stream)
 	{
-		entityDataIndexMap_.clear();
+		entityLocations_.clear();
 		archetypes_.clear();
+		for (auto& query : cachedQueries_)
+			query->clearChunks();
+		clearComponentEvents();
+		archetypeIndexByTypes_.clear();
+		freeArchetypeIndices_.clear();
 		entityCommandBuffer_.clear();
-		nextEntityId = 1;
 
 		size_t typeDescCount = 0;
 		stream.read((char*)&typeDescCount, sizeof(typeDescCount));
@@ -464,6 +837,8 @@ namespace ecs
 			archetype->load(stream, typeIdsByLoadedIndex);
 		}
 
+		entityLocations_.loadGenerations(stream);
+
 		size_t entityCount = 0;
 		stream.read((char*)&entityCount, sizeof(entityCount));
 		for (size_t i = 0; i < entityCount; i++)
@@ -475,6 +850,6 @@ namespace ecs
 			setEntityIndexMap(id, dataIndex);
 		}
 
-		stream.read((char*)&nextEntityId, sizeof(nextEntityId));
+		entityLocations_.rebuildFreeList();
 	}
 }
@@ -1,8 +1,17 @@
 #pragma once
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <string>
 #include <utility>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <type_traits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace ecs
 {
@@ -16,11 +25,24 @@ namespace ecs
 			static auto test(...)->std::false_type;
 			using type = decltype(test(std::declval<L>(), std::declval<R>()));
 		};
+
+		template<typename T>
+		struct has_save_load_impl
+		{
+			template<typename U = T>
+			static auto test(U* u) -> decltype(static_cast<const U*>(u)->save(std::declval<istream&>()), u->load(std::declval<istream&>()), void(), std::true_type{});
+			static auto test(...)->std::false_type;
+			using type = decltype(test(std::declval<T*>()));
+		};
 	} // namespace detail
 
 	template<typename L, typename R = L>
 	struct has_operator_equals : detail::has_operator_equals_impl<L, R>::type {};
 
+	// Components that aren't trivially copyable get saved with their members void save(istream&) const and void load(istream&)
+	template<typename T>
+	struct has_save_load : detail::has_save_load_impl<T>::type {};
+
 	template<class T>
 	using tempList = std::vector<T>;
 
@@ -80,9 +102,126 @@ namespace ecs
 		Internal	// For internal use
 	};
 
-	using entityId = int;
+	// Low 32 bits: slot index in the EntityLocationTable, high bits: generation of the slot.
+	// Negative ids are temporary ids handed out by the command buffer.
+	using entityId = int64_t;
+
+	static inline const int maxEntityGeneration = 0x7fffffff;
+
+	inline uint32_t getEntityIndex(entityId id)
+	{
+		return (uint32_t)(id & 0xffffffff);
+	}
+
+	inline int getEntityGeneration(entityId id)
+	{
+		return (int)(id >> 32);
+	}
+
+	inline entityId makeEntityId(uint32_t index, int generation)
+	{
+		return ((entityId)generation << 32) | index;
+	}
+
+	// Type erased operations on ranges of components, so the chunks can work on whole columns without knowing the types.
+	// Trivially copyable types get memcpy/memset versions.
+	struct ComponentOps
+	{
+		void (*construct)(void* dest, int count);	// value initializes
+		void (*destroy)(void* dest, int count);
+		void (*relocate)(void* dest, void* source, int count);		// moves to uninitialized memory and destroys the source, the ranges can't overlap
+		void (*copy)(void* dest, const void* source, int count);	// assigns to constructed elements
+		bool (*equals)(const void* a, const void* b);
+		void (*save)(istream& stream, const void* source, int count);	// nullptr if the type can't be saved (see has_save_load)
+		void (*load)(istream& stream, void* dest, int count);			// into constructed elements
+	};
+
+	template<class T>
+	ComponentOps makeComponentOps()
+	{
+		ComponentOps ops;
+		if constexpr (std::is_trivially_default_constructible_v<T>)
+		{
+			ops.construct = [](void* dest, int count) { memset(dest, 0, count * sizeof(T)); };
+		}
+		else
+		{
+			ops.construct = [](void* dest, int count) { std::uninitialized_value_construct_n(static_cast<T*>(dest), count); };
+		}
+
+		if constexpr (std::is_trivially_destructible_v<T>)
+		{
+			ops.destroy = [](void*, int) {};
+		}
+		else
+		{
+			ops.destroy = [](void* dest, int count) { std::destroy_n(static_cast<T*>(dest), count); };
+		}
+
+		if constexpr (std::is_trivially_copyable_v<T>)
+		{
+			ops.relocate = [](void* dest, void* source, int count) { memcpy(dest, source, count * sizeof(T)); };
+			ops.copy = [](void* dest, const void* source, int count) { memcpy(dest, source, count * sizeof(T)); };
+		}
+		else
+		{
+			ops.relocate = [](void* dest, void* source, int count)
+			{
+				T* tSource = static_cast<T*>(source);
+				std::uninitialized_move_n(tSource, count, static_cast<T*>(dest));
+				std::destroy_n(tSource, count);
+			};
+			ops.copy = [](void* dest, const void* source, int count) { std::copy_n(static_cast<const T*>(source), count, static_cast<T*>(dest)); };
+		}
+
+		ops.equals = [](const void* a, const void* b) { return equals(*static_cast<const T*>(a), *static_cast<const T*>(b)); };
+		if constexpr (std::is_trivially_copyable_v<T>)
+		{
+			ops.save = [](istream& stream, const void* source, int count) { stream.write((const char*)source, count * sizeof(T)); };
+			ops.load = [](istream& stream, void* dest, int count) { stream.read((char*)dest, count * sizeof(T)); };
+		}
+		else if constexpr (has_save_load<T>::value)
+		{
+			ops.save = [](istream& stream, const void* source, int count)
+			{
+				for (int i = 0; i < count; i++)
+					static_cast<const T*>(source)[i].save(stream);
+			};
+			ops.load = [](istream& stream, void* dest, int count)
+			{
+				for (int i = 0; i < count; i++)
+					static_cast<T*>(dest)[i].load(stream);
+			};
+		}
+		else
+		{
+			ops.save = nullptr;
+			ops.load = nullptr;
+		}
+		return ops;
+	}
 
 	using typeIndex = int;
+	// A member of a component that's stored field by field
+	struct FieldDescriptor
+	{
+		int offset;		// in the component struct
+		int size;
+		int alignment;
+	};
+
+	// One field array of a component stored field by field, in one chunk
+	template<class T>
+	struct FieldSpan
+	{
+		T* data = nullptr;
+		int size = 0;
+
+		T* begin() const { return data; }
+		T* end() const { return data + size; }
+		T& operator[](int index) const { return data[index]; }
+	};
+
 	struct TypeDescriptor
 	{
 		typeIndex index;
@@ -90,10 +229,24 @@ namespace ecs
 		int alignment;
 		ComponentType type;
 		std::string name;
+		ComponentOps ops;
+		std::vector<FieldDescriptor> fields;	// not empty if the chunks store the component as one array per field (structure of arrays)
+		std::vector<uint8_t> defaultValue;		// a value initialized component to construct the fields from
 	};
 
 	using typeId = TypeDescriptor*;
 
+	// A component without save functions would silently load back default constructed, so saving one is an error. It gets left out of the stream.
+	inline bool isSaveable(typeId tid)
+	{
+		if (tid->ops.save)
+			return true;
+
+		printf("Component %s can't be saved, it isn't trivially copyable and has no save and load functions!\n", tid->name.c_str());
+		_ASSERT_EXPR(false, L"Saving a component that isn't trivially copyable and has no save and load functions!");
+		return false;
+	}
+
 #ifdef _DEBUG
 #define DEBUG_TYPEIDLISTS
 #endif
@@ -105,17 +258,44 @@ namespace ecs
 		int elementIndex;
 	};
 
+#ifndef ECS_MAX_TYPE_COUNT
+#define ECS_MAX_TYPE_COUNT 256	// the capacity of the type sets, can be raised in multiples of 64
+#endif
+
+	inline int popCount64(uint64_t word)
+	{
+#ifdef _MSC_VER
+		return (int)__popcnt64(word);
+#else
+		return __builtin_popcountll(word);
+#endif
+	}
+
+	inline int countTrailingZeros64(uint64_t word)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return (int)index;
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+	// A set of component types as a fixed size inline bitset. It never allocates, and comparing two sets is a handful of word operations the compiler vectorizes.
+	// The totalTypeCount of the constructors is only checked against the capacity, sets created with different type counts are compatible.
 	struct typeIdList
 	{
+		static inline const int maxTypeCount = ECS_MAX_TYPE_COUNT;
+		static inline const int wordCount = maxTypeCount / 64;
+		static_assert(maxTypeCount % 64 == 0, "ECS_MAX_TYPE_COUNT has to be a multiple of 64");
+
 		typeIdList(size_t totalTypeCount, std::initializer_list<typeId> tids)
 		{
-			size_t byteCount = (totalTypeCount + 7) / 8;
-			bitField.resize(byteCount);
+			_ASSERT_EXPR(totalTypeCount <= (size_t)maxTypeCount, L"Too many component types, raise ECS_MAX_TYPE_COUNT!");
 			for (auto& tid : tids)
 			{
-				size_t byteIndex = tid->index / 8;
-				size_t bitIndex = tid->index % 8;
-				bitField[byteIndex] |= 1 << bitIndex;
+				setBit(tid->index);
 			}
 
 #ifdef DEBUG_TYPEIDLISTS
@@ -126,8 +306,7 @@ namespace ecs
 
 		typeIdList(size_t totalTypeCount, const std::initializer_list<typeId> tids, const std::initializer_list<bool> keep)
 		{
-			size_t byteCount = (totalTypeCount + 7) / 8;
-			bitField.resize(byteCount);
+			_ASSERT_EXPR(totalTypeCount <= (size_t)maxTypeCount, L"Too many component types, raise ECS_MAX_TYPE_COUNT!");
 
 			auto itTid = std::begin(tids);
 			auto itFilter = std::begin(keep);
@@ -137,9 +316,7 @@ namespace ecs
 				if (keep)
 				{
 					typeId tid = *itTid;
-					size_t byteIndex = tid->index / 8;
-					size_t bitIndex = tid->index % 8;
-					bitField[byteIndex] |= 1 << bitIndex;
+					setBit(tid->index);
 
 #ifdef DEBUG_TYPEIDLISTS
 					typeIds.push_back(tid);
@@ -156,7 +333,12 @@ namespace ecs
 
 		bool operator==(const typeIdList& rhs) const
 		{
-			return bitField == rhs.bitField;
+			uint64_t difference = 0;
+			for (int i = 0; i < wordCount; i++)
+			{
+				difference |= words[i] ^ rhs.words[i];
+			}
+			return difference == 0;
 		}
 
 		bool operator!=(const typeIdList& rhs) const
@@ -179,9 +361,9 @@ namespace ecs
 
 		void addTypes(const typeIdList& typesToAdd)
 		{
-			for (size_t i = 0; i < bitField.size(); i++)
+			for (int i = 0; i < wordCount; i++)
 			{
-				bitField[i] = bitField[i] | (typesToAdd.bitField[i]);
+				words[i] |= typesToAdd.words[i];
 			}
 
 #ifdef DEBUG_TYPEIDLISTS
@@ -211,9 +393,9 @@ namespace ecs
 
 		void deleteTypes(const typeIdList& typesToDelete)
 		{
-			for (size_t i = 0; i < bitField.size(); i++)
+			for (int i = 0; i < wordCount; i++)
 			{
-				bitField[i] = bitField[i] & (~typesToDelete.bitField[i]);
+				words[i] &= ~typesToDelete.words[i];
 			}
 
 #ifdef DEBUG_TYPEIDLISTS
@@ -228,17 +410,52 @@ namespace ecs
 #endif
 		}
 
+		// No early out, the whole set is checked with a few word operations
 		bool hasAllTypes(const typeIdList& requiredTypes) const
 		{
-			auto& reqBitField = requiredTypes.getBitfield();
-			for (size_t i = 0; i < bitField.size(); i++)
+			uint64_t missing = 0;
+			for (int i = 0; i < wordCount; i++)
 			{
-				uint8_t byteToCheck = bitField[i];
-				uint8_t byteReq = reqBitField[i];
-				if ((byteToCheck & byteReq) != byteReq)
-					return false;
+				missing |= requiredTypes.words[i] & ~words[i];
 			}
-			return true;
+			return missing == 0;
+		}
+
+		void intersectTypes(const typeIdList& typesToKeep)
+		{
+			for (int i = 0; i < wordCount; i++)
+			{
+				words[i] &= typesToKeep.words[i];
+			}
+
+#ifdef DEBUG_TYPEIDLISTS
+			typeIds.erase(std::remove_if(typeIds.begin(), typeIds.end(), [&](typeId t) { return !typesToKeep.hasType(t); }), typeIds.end());
+#endif
+		}
+
+		// Calls fn(int typeIndex) for every type in the set
+		template<class Fn>
+		void forEachTypeIndex(Fn&& fn) const
+		{
+			for (int i = 0; i < wordCount; i++)
+			{
+				uint64_t word = words[i];
+				while (word)
+				{
+					fn(i * 64 + countTrailingZeros64(word));
+					word &= word - 1;
+				}
+			}
+		}
+
+		bool hasAnyType(const typeIdList& types) const
+		{
+			uint64_t common = 0;
+			for (int i = 0; i < wordCount; i++)
+			{
+				common |= types.words[i] & words[i];
+			}
+			return common != 0;
 		}
 
 		bool hasType(const typeId& type) const
@@ -252,14 +469,11 @@ namespace ecs
 
 			for (size_t i = 0; i < allRegisteredTypeIds.size(); i++)
 			{
-				size_t byteIndex = i / 8;
-				size_t bitIndex = i % 8;
-				bool hasType = bitField[byteIndex] & (1 << bitIndex);
-				if (hasType)
+				if (getBit((int)i))
 				{
 					auto componentType = allRegisteredTypeIds[i]->type;
 					if (componentType == ComponentType::State)
-						ret.bitField[byteIndex] |= 1 << bitIndex;
+						ret.setBit((int)i);
 				}
 			}
 
@@ -275,15 +489,12 @@ namespace ecs
 
 			for (size_t i = 0; i < allRegisteredTypeIds.size(); i++)
 			{
-				size_t byteIndex = i / 8;
-				size_t bitIndex = i % 8;
-				bool hasType = bitField[byteIndex] & (1 << bitIndex);
-				if (hasType)
+				if (getBit((int)i))
 				{
 					auto componentType = allRegisteredTypeIds[i]->type;
 					if (componentType == ComponentType::DontSave || componentType == ComponentType::State || componentType == ComponentType::Internal)
 						continue;
-					ret.bitField[byteIndex] |= 1 << bitIndex;
+					ret.setBit((int)i);
 				}
 			}
 
@@ -294,7 +505,7 @@ namespace ecs
 			return ret;
 		}
 
-		const std::vector<uint8_t>& getBitfield() const { return bitField; }
+		const std::array<uint64_t, wordCount>& getWords() const { return words; }
 
 		std::vector<typeId> calcTypeIds(const std::vector<typeId>& allRegisteredTypeIds) const 
 		{
@@ -309,35 +520,50 @@ namespace ecs
 			return ret;
 		}
 
+		// FNV-1a over the words, consistent with operator==
+		size_t hash() const
+		{
+			uint64_t ret = 14695981039346656037ull;
+			for (auto& w : words)
+			{
+				ret ^= w;
+				ret *= 1099511628211ull;
+			}
+			return (size_t)ret;
+		}
+
 		bool isEmpty() const
 		{
-			for (auto& b : bitField)
+			uint64_t any = 0;
+			for (auto& w : words)
 			{
-				if (b != 0)
-					return false;
+				any |= w;
 			}
-			return true;
+			return any == 0;
 		}
 
 		size_t calcTypeCount() const
 		{
 			size_t ret = 0;
-			for (auto& b : bitField)
+			for (auto& w : words)
 			{
-				for (uint8_t i = 0; i < 8; i++)
-				{
-					if (b & (1 << i))
-						ret++;
-				}
+				ret += popCount64(w);
 			}
 			return ret;
 		}
 
+		// Saved as a byte per 8 types, the same format as when the set was a byte array
 		void save(istream& stream) const
 		{
-			size_t count = bitField.size();
+			uint8_t bytes[maxTypeCount / 8];
+			for (int i = 0; i < maxTypeCount / 8; i++)
+			{
+				bytes[i] = (uint8_t)(words[i / 8] >> (i % 8 * 8));
+			}
+
+			size_t count = sizeof(bytes);
 			stream.write((const char*)&count, sizeof(count));
-			stream.write((const char*)bitField.data(), bitField.size() * sizeof(uint8_t));
+			stream.write((const char*)bytes, sizeof(bytes));
 		}
 
 		void load(istream& stream, const std::vector<typeId>& typeIdsByLoadedIndex)
@@ -351,16 +577,13 @@ namespace ecs
 			std::vector<uint8_t> loadedBitfield(s);
 			stream.read((char*)loadedBitfield.data(), s * sizeof(uint8_t));
 
-			for (int i = 0; i < (int)typeIdsByLoadedIndex.size(); i++)
+			for (int i = 0; i < (int)typeIdsByLoadedIndex.size() && i / 8 < (int)s; i++)
 			{
 				int loadByteIndex = i / 8;
 				int loadBitIndex = i % 8;
 				if (loadedBitfield[loadByteIndex] & (1 << loadBitIndex))
 				{
-					int currentIndex = typeIdsByLoadedIndex[i]->index;
-					int currentByteIndex = currentIndex / 8;
-					int currentBitIndex = currentIndex % 8;
-					bitField[currentByteIndex] |= 1 << currentBitIndex;
+					setBit(typeIdsByLoadedIndex[i]->index);
 
 #ifdef DEBUG_TYPEIDLISTS
 					typeIds.push_back(typeIdsByLoadedIndex[i]);
@@ -372,29 +595,28 @@ namespace ecs
 	private:
 		bool getBit(int typeIndex) const
 		{
-			int byteIndex = typeIndex / 8;
-			int bitIndex = typeIndex % 8;
-			return bitField[byteIndex] & (1 << bitIndex);
+			return (words[typeIndex / 64] >> (typeIndex % 64)) & 1;
 		}
 
 		void setBit(int typeIndex)
 		{
-			int byteIndex = typeIndex / 8;
-			int bitIndex = typeIndex % 8;
-			bitField[byteIndex] |= 1 << bitIndex;
+			words[typeIndex / 64] |= 1ull << (typeIndex % 64);
 		}
 
 		void clearBit(int typeIndex)
 		{
-			int byteIndex = typeIndex / 8;
-			int bitIndex = typeIndex % 8;
-			bitField[byteIndex] &= ~(1 << bitIndex);
+			words[typeIndex / 64] &= ~(1ull << (typeIndex % 64));
 		}
 
 #ifdef DEBUG_TYPEIDLISTS
 		std::vector<typeId> typeIds;
 #endif
-		std::vector<uint8_t> bitField;
+		std::array<uint64_t, wordCount> words = {};
+	};
+
+	struct typeIdListHash
+	{
+		size_t operator()(const typeIdList& typeIds) const { return typeIds.hash(); }
 	};
 
 	struct TypeQueryItem
@@ -433,18 +655,7 @@ namespace ecs
 	public:
 		bool check(const typeIdList& listToCheck) const
 		{
-			for (size_t i = 0; i < listToCheck.getBitfield().size(); i++)
-			{
-				uint8_t byteToCheck = listToCheck.getBitfield()[i];
-				uint8_t byteReq = required.getBitfield()[i];
-				uint8_t byteEx = excluded.getBitfield()[i];
-				if ((byteToCheck & byteReq) != byteReq)
-					return false;
-
-				if ((byteToCheck & byteEx) != 0)
-					return false;
-			}
-			return true;
+			return listToCheck.hasAllTypes(required) && !listToCheck.hasAnyType(excluded);
 		}
 
 		typeIdList required;
@@ -483,12 +694,12 @@ namespace ecs
 		template<class T>
 		void saveComponent(istream& stream, const typeId& tid, const T& value, ComponentType expectedType) const
 		{
-			if (tid->type != expectedType)
+			if (tid->type != expectedType || !isSaveable(tid))
 				return;
 
 			int componentIndex = tid->index;
 			stream.write((char*)&componentIndex, sizeof(componentIndex));
-			stream.write((char*)&value, sizeof(value));
+			tid->ops.save(stream, &value, 1);
 		}
 
 		template<size_t... Is>
@@ -0,0 +1,270 @@
+#pragma once
+#include "ecs_util.h"
+#include <algorithm>
+#include <vector>
+
+namespace ecs
+{
+	// The entity ids returned by the bulk creation functions: the recycled ids of released slots, then a contiguous run of new ids.
+	// The recycled ids aren't contiguous, every slot has its own generation.
+	struct EntityRange
+	{
+		struct iterator
+		{
+			entityId operator*() const { return (*range)[index]; }
+			iterator& operator++() { index++; return *this; }
+			bool operator==(const iterator& rhs) const { return index == rhs.index; }
+			bool operator!=(const iterator& rhs) const { return index != rhs.index; }
+			const EntityRange* range;
+			int index;
+		};
+
+		entityId operator[](int index) const
+		{
+			int recycledCount = (int)recycledIds.size();
+			return index < recycledCount ? recycledIds[index] : first + (index - recycledCount);
+		}
+
+		iterator begin() const { return { this, 0 }; }
+		iterator end() const { return { this, count }; }
+		int size() const { return count; }
+
+		std::vector<entityId> recycledIds;
+		entityId first = 0;		// the first new id, they are contiguous because new slots are at generation 0
+		int count = 0;
+	};
+
+	// Hands out entity ids and maps them to their location in the archetypes.
+	// An entity id is a slot index in the low 32 bits and the generation of the slot in the high bits.
+	// Released slots are recycled with a bumped generation, so stale ids never find the new entity.
+	// The slots are stored in pages indexed directly by the slot index, so a lookup is a shift, a mask and one compare.
+	// Pages are allocated on the first write and never move, so pointers returned by find stay valid until clear.
+	struct EntityLocationTable
+	{
+		static inline const int pageBits = 12;
+		static inline const int pageSize = 1 << pageBits;
+		static inline const int pageMask = pageSize - 1;
+
+		EntityLocationTable() = default;
+		EntityLocationTable(const EntityLocationTable&) = delete;
+		EntityLocationTable& operator=(const EntityLocationTable&) = delete;
+
+		~EntityLocationTable()
+		{
+			clear();
+		}
+
+		entityId create()
+		{
+			int index;
+			if (freeIndices.size())
+			{
+				index = freeIndices.back();
+				freeIndices.pop_back();
+			}
+			else
+			{
+				index = slotCount++;
+				allocatePage(index >> pageBits);
+			}
+
+			Slot& slot = pages[index >> pageBits][index & pageMask];
+			slot.id = makeEntityId(index, slot.generation);
+			slot.location = invalidIndex;
+			count++;
+			return slot.id;
+		}
+
+		// Takes the released slots first like create, so creating and deleting in bulk doesn't grow the table
+		EntityRange createRange(int rangeCount)
+		{
+			EntityRange range;
+			range.count = rangeCount;
+			int recycledCount = std::min(rangeCount, (int)freeIndices.size());
+			range.recycledIds.reserve(recycledCount);
+			for (int i = 0; i < recycledCount; i++)
+			{
+				int index = freeIndices.back();
+				freeIndices.pop_back();
+				Slot& slot = pages[index >> pageBits][index & pageMask];
+				slot.id = makeEntityId(index, slot.generation);
+				slot.location = invalidIndex;
+				range.recycledIds.push_back(slot.id);
+			}
+
+			int firstIndex = slotCount;
+			int newCount = rangeCount - recycledCount;
+			slotCount += newCount;
+			if (newCount > 0)
+			{
+				for (int iPage = firstIndex >> pageBits; iPage <= (slotCount - 1) >> pageBits; iPage++)
+					allocatePage(iPage);
+			}
+
+			for (int i = firstIndex; i < slotCount; i++)
+			{
+				Slot& slot = pages[i >> pageBits][i & pageMask];
+				_ASSERT(slot.generation == 0);
+				slot.id = makeEntityId(i, 0);
+				slot.location = invalidIndex;
+			}
+			range.first = makeEntityId(firstIndex, 0);
+			count += rangeCount;
+			return range;
+		}
+
+		// Returns nullptr if the entity is not alive (or the id is stale)
+		entityDataIndex* find(entityId id)
+		{
+			size_t pageIndex = (size_t)getEntityIndex(id) >> pageBits;
+			if (pageIndex >= pages.size())
+				return nullptr;
+
+			// Pages that were never written point to the shared invalid page, so we don't need a null check here
+			Slot& slot = pages[pageIndex][getEntityIndex(id) & pageMask];
+			return slot.id == id ? &slot.location : nullptr;
+		}
+
+		const entityDataIndex* find(entityId id) const
+		{
+			return const_cast<EntityLocationTable*>(this)->find(id);
+		}
+
+		// Also used to insert entities with an already known id (loading)
+		void set(entityId id, const entityDataIndex& index)
+		{
+			uint32_t slotIndex = getEntityIndex(id);
+			allocatePage(slotIndex >> pageBits);
+			slotCount = std::max(slotCount, (int)slotIndex + 1);
+
+			Slot& slot = pages[slotIndex >> pageBits][slotIndex & pageMask];
+			if (slot.id == deadSlot)
+				count++;
+			slot.id = id;
+			slot.generation = getEntityGeneration(id);
+			slot.location = index;
+		}
+
+		bool release(entityId id)
+		{
+			entityDataIndex* location = find(id);
+			if (!location)
+				return false;
+
+			uint32_t slotIndex = getEntityIndex(id);
+			Slot& slot = pages[slotIndex >> pageBits][slotIndex & pageMask];
+			slot.id = deadSlot;
+			slot.location = invalidIndex;
+			slot.generation = (slot.generation + 1) & maxEntityGeneration;
+			freeIndices.push_back((int)slotIndex);
+			count--;
+			return true;
+		}
+
+		void clear()
+		{
+			for (auto page : pages)
+			{
+				if (page != getInvalidPage())
+					delete[] page;
+			}
+			pages.clear();
+			freeIndices.clear();
+			slotCount = 1;
+			count = 0;
+		}
+
+		size_t size() const { return count; }
+		// Every slot ever used, alive or released. Stays close to the peak entity count as long as released slots get reused.
+		int getSlotCount() const { return slotCount; }
+
+		template<class Fn>
+		void forEach(Fn&& fn) const
+		{
+			for (size_t iPage = 0; iPage < pages.size(); iPage++)
+			{
+				if (pages[iPage] == getInvalidPage())
+					continue;
+
+				for (int i = 0; i < pageSize; i++)
+				{
+					const Slot& slot = pages[iPage][i];
+					if (slot.id != deadSlot)
+						fn(slot.id, slot.location);
+				}
+			}
+		}
+
+		// The generations are saved for every slot, so ids handed out after loading won't match ids that were stale before saving
+		void saveGenerations(istream& stream) const
+		{
+			stream.write((const char*)&slotCount, sizeof(slotCount));
+			for (int i = 0; i < slotCount; i++)
+			{
+				int generation = (size_t)(i >> pageBits) < pages.size() ? pages[i >> pageBits][i & pageMask].generation : 0;
+				stream.write((const char*)&generation, sizeof(generation));
+			}
+		}
+
+		void loadGenerations(istream& stream)
+		{
+			clear();
+			stream.read((char*)&slotCount, sizeof(slotCount));
+			for (int i = 0; i < slotCount; i++)
+			{
+				allocatePage(i >> pageBits);
+				stream.read((char*)&pages[i >> pageBits][i & pageMask].generation, sizeof(int));
+			}
+		}
+
+		// Call this after all the loaded entities are set
+		void rebuildFreeList()
+		{
+			freeIndices.clear();
+			for (int i = slotCount - 1; i > 0; i--)
+			{
+				if (pages[i >> pageBits][i & pageMask].id == deadSlot)
+					freeIndices.push_back(i);
+			}
+		}
+
+	private:
+		struct Slot
+		{
+			entityId id;				// The id living in this slot or deadSlot
+			entityDataIndex location;
+			int generation;				// The generation of the id living here, or of the next one if the slot is free
+		};
+
+		static inline const entityId deadSlot = -1;	// Negative ids never get past the page bounds check, so this can't match a lookup
+		static inline const entityDataIndex invalidIndex = { -1, -1, -1 };
+
+		static Slot* getInvalidPage()
+		{
+			static Slot* invalidPage = []()
+			{
+				static Slot page[pageSize];
+				std::fill(page, page + pageSize, Slot{ deadSlot, invalidIndex, 0 });
+				return page;
+			}();
+			return invalidPage;
+		}
+
+		void allocatePage(size_t pageIndex)
+		{
+			if (pageIndex >= pages.size())
+				pages.resize(pageIndex + 1, getInvalidPage());
+
+			if (pages[pageIndex] == getInvalidPage())
+			{
+				pages[pageIndex] = new Slot[pageSize];
+				std::fill(pages[pageIndex], pages[pageIndex] + pageSize, Slot{ deadSlot, invalidIndex, 0 });
+			}
+		}
+
+		std::vector<Slot*> pages;
+		std::vector<int> freeIndices;
+		int slotCount = 1;	// Slot 0 is never used so 0 stays an invalid id
+		size_t count = 0;
+	};
+}
@@ -5,6 +5,7 @@ namespace ecs
 {
 	struct EntityCommand
 	{
+		virtual ~EntityCommand() = default;
 		virtual void execute(struct Ecs& ecs) = 0;
 	};
 
@@ -20,7 +21,7 @@ namespace ecs
 		void execute(Ecs& ecs) override
 		{
 			entityId newId = std::apply([&](auto... x) { return ecs.createEntity<Ts...>(x...); }, args);
-			ecs.temporaryEntityIdRemapping_[temporaryId] = newId;
+			ecs.setTemporaryEntityIdRemapping(temporaryId, newId);
 		}
 
 		entityId temporaryId;
@@ -40,7 +41,7 @@ namespace ecs
 		void execute(Ecs& ecs) override
 		{
 			entityId newId = std::apply([&](auto... x) { return ecs.createEntity(*prefab, x...); }, args);
-			ecs.temporaryEntityIdRemapping_[temporaryId] = newId;
+			ecs.setTemporaryEntityIdRemapping(temporaryId, newId);
 		}
 
 		entityId temporaryId;
@@ -56,11 +57,7 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override 
 		{
-			entityId idToDelete = id;
-			if (idToDelete < 0)
-			{
-				idToDelete = ecs.temporaryEntityIdRemapping_[id];
-			}
+			entityId idToDelete = ecs.resolveTemporaryEntityId(id);
 
 			ecs.deleteEntity(idToDelete, true);
 		}
@@ -78,15 +75,12 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override
 		{
-			entityId idToUse = id;
-			if (idToUse < 0)
-				idToUse = ecs.temporaryEntityIdRemapping_[id];
+			entityId idToUse = ecs.resolveTemporaryEntityId(id);
 
-			auto comp = ecs.getComponent<T>(idToUse);
-			if (comp)
-				*comp = data;
+			if (ecs.hasAllComponents<T>(idToUse))
+				ecs.setComponent(idToUse, data);
 			else
-				printf("EntityCommand_SetComponent: Component data not found. Id: %d; Type: %s.", idToUse, ecs.getTypeId<T>()->name.c_str());
+				printf("EntityCommand_SetComponent: Component data not found. Id: %lld; Type: %s.", (long long)idToUse, ecs.getTypeId<T>()->name.c_str());
 		}
 
 		entityId id;
@@ -103,9 +97,7 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override
 		{
-			entityId idToUse = id;
-			if (idToUse < 0)
-				idToUse = ecs.temporaryEntityIdRemapping_[id];
+			entityId idToUse = ecs.resolveTemporaryEntityId(id);
 
 			ecs.setSharedComponent(idToUse, data);
 		}
@@ -123,9 +115,7 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override
 		{
-			entityId idToUse = id;
-			if (idToUse < 0)
-				idToUse = ecs.temporaryEntityIdRemapping_[id];
+			entityId idToUse = ecs.resolveTemporaryEntityId(id);
 
 			ecs.deleteComponents(idToUse, types);
 		}
@@ -144,9 +134,7 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override
 		{
-			entityId idToUse = id;
-			if (idToUse < 0)
-				idToUse = ecs.temporaryEntityIdRemapping_[id];
+			entityId idToUse = ecs.resolveTemporaryEntityId(id);
 
 			ecs.addComponent(idToUse, data);
 		}
@@ -164,9 +152,7 @@ namespace ecs
 
 		void execute(struct Ecs& ecs) override
 		{
-			entityId idToUse = id;
-			if (idToUse < 0)
-				idToUse = ecs.temporaryEntityIdRemapping_[id];
+			entityId idToUse = ecs.resolveTemporaryEntityId(id);
 
 			ecs.changeComponents(idToUse, types);
 		}
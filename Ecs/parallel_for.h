@@ -0,0 +1,142 @@
+#pragma once
+#include "ftl/atomic_counter.h"
+#include "ftl/task_scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace ecs
+{
+	// Loops with fewer entities than this run inline on the calling thread, the task overhead would eat the gain
+	constexpr int parallelForMinEntityCount = 4096;
+	// A work item never gets smaller than this many entities, even when a chunk is split for load balancing
+	constexpr int parallelForMinSliceSize = 64;
+	// Work items aimed at per worker thread, more items balance better but cost more atomic operations
+	constexpr int parallelForSlicesPerThread = 8;
+
+	// The work items [begin, end) a worker hasn't started yet. The owner takes items from the front, other workers steal the back half.
+	struct alignas(64) StealableRange
+	{
+		static uint64_t pack(uint32_t begin, uint32_t end) { return ((uint64_t)end << 32) | begin; }
+
+		void set(uint32_t begin, uint32_t end)
+		{
+			range.store(pack(begin, end));
+		}
+
+		// False if there is nothing left
+		bool takeFront(uint32_t& outItem)
+		{
+			uint64_t current = range.load();
+			while (true)
+			{
+				uint32_t begin = (uint32_t)current;
+				uint32_t end = (uint32_t)(current >> 32);
+				if (begin >= end)
+					return false;
+
+				if (range.compare_exchange_weak(current, pack(begin + 1, end)))
+				{
+					outItem = begin;
+					return true;
+				}
+			}
+		}
+
+		// Splits off the back half, the last item too if only one is left
+		bool stealHalf(uint32_t& outBegin, uint32_t& outEnd)
+		{
+			uint64_t current = range.load();
+			while (true)
+			{
+				uint32_t begin = (uint32_t)current;
+				uint32_t end = (uint32_t)(current >> 32);
+				if (begin >= end)
+					return false;
+
+				uint32_t middle = begin + (end - begin) / 2;
+				if (range.compare_exchange_weak(current, pack(begin, middle)))
+				{
+					outBegin = middle;
+					outEnd = end;
+					return true;
+				}
+			}
+		}
+
+		std::atomic<uint64_t> range = 0;
+	};
+
+	// Runs fn(int itemIndex) for every item in [0, itemCount) on the worker threads of the task scheduler and waits for all of them.
+	// Every worker starts with an even share of the items and steals from the others when it runs dry, so uneven items still balance.
+	// Callable from the main thread and from inside tasks.
+	template<class Fn>
+	void parallelFor(ftl::TaskScheduler* taskScheduler, int itemCount, Fn& fn)
+	{
+		struct Context
+		{
+			Fn* fn;
+			std::vector<StealableRange> ranges;
+		};
+
+		struct WorkerArg
+		{
+			Context* context;
+			int workerIndex;
+		};
+
+		auto workerFn = [](ftl::TaskScheduler*, void* arg)
+		{
+			auto [context, workerIndex] = *reinterpret_cast<WorkerArg*>(arg);
+			std::vector<StealableRange>& ranges = context->ranges;
+			StealableRange& ownRange = ranges[workerIndex];
+			int workerCount = (int)ranges.size();
+
+			while (true)
+			{
+				uint32_t item;
+				while (ownRange.takeFront(item))
+				{
+					(*context->fn)((int)item);
+				}
+
+				bool stole = false;
+				for (int i = 1; i < workerCount && !stole; i++)
+				{
+					uint32_t begin, end;
+					if (ranges[(workerIndex + i) % workerCount].stealHalf(begin, end))
+					{
+						ownRange.set(begin, end);
+						stole = true;
+					}
+				}
+
+				if (!stole)
+					return;
+			}
+		};
+
+		int workerCount = std::min(itemCount, (int)taskScheduler->GetThreadCount());
+		if (workerCount <= 1)
+		{
+			for (int i = 0; i < itemCount; i++)
+				fn(i);
+			return;
+		}
+
+		Context context{ &fn, std::vector<StealableRange>(workerCount) };
+		std::vector<WorkerArg> args(workerCount);
+		std::vector<ftl::Task> tasks(workerCount);
+		for (int i = 0; i < workerCount; i++)
+		{
+			context.ranges[i].set(uint32_t((int64_t)itemCount * i / workerCount), uint32_t((int64_t)itemCount * (i + 1) / workerCount));
+			args[i] = { &context, i };
+			tasks[i].ArgData = &args[i];
+			tasks[i].Function = workerFn;
+		}
+
+		ftl::AtomicCounter counter(taskScheduler);
+		taskScheduler->AddTasks(workerCount, tasks.data(), &counter);
+		taskScheduler->WaitForCounter(&counter, 0, true);
+	}
+}
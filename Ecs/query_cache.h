@@ -0,0 +1,97 @@
+#pragma once
+#include "component_array.h"
+#include <algorithm>
+#include <array>
+
+namespace ecs
+{
+	template<size_t ComponentCount>
+	struct QueriedChunk
+	{
+		std::array<uint8_t*, ComponentCount + 1> buffers;	// the first buffer is the entity ids, the rest are the component arrays in the order of the view
+		Chunk* chunk;
+	};
+
+	// The chunks of a view: the first count chunks of the cached list of its query, or the view's own filtered list.
+	// Reads the list by index, so chunks appended during an iteration (entities created in the loop) don't invalidate it, they're just not visited.
+	template<size_t ComponentCount>
+	struct QueriedChunkRange
+	{
+		struct iterator
+		{
+			const QueriedChunk<ComponentCount>& operator*() const { return (*range)[index]; }
+			iterator& operator++() { index++; return *this; }
+			bool operator!=(const iterator& rhs) const { return index != rhs.index; }
+			const QueriedChunkRange* range;
+			int index;
+		};
+
+		const QueriedChunk<ComponentCount>& operator[](int index) const { return (*chunks)[index]; }
+		size_t size() const { return count; }
+		iterator begin() const { return { this, 0 }; }
+		iterator end() const { return { this, count }; }
+
+		const std::vector<QueriedChunk<ComponentCount>>* chunks;
+		int count;
+	};
+
+	// A query whose matching chunks are kept up to date by the Ecs as chunks are created and deleted, so views don't scan the archetypes.
+	// The archetypes remember the queries they match and report their chunk changes to them.
+	struct CachedQueryBase
+	{
+		CachedQueryBase(const typeQueryList& query, std::vector<typeId> componentTypeIds)
+			: query(query)
+			, componentTypeIds(std::move(componentTypeIds))
+		{}
+		virtual ~CachedQueryBase() = default;
+
+		virtual void addChunk(Chunk* chunk) = 0;
+		virtual void removeChunk(Chunk* chunk) = 0;
+		virtual void clearChunks() = 0;
+
+		bool matches(const typeQueryList& otherQuery, const typeId* otherComponentTypeIds, size_t componentCount) const
+		{
+			return query.required == otherQuery.required && query.excluded == otherQuery.excluded &&
+				std::equal(componentTypeIds.begin(), componentTypeIds.end(), otherComponentTypeIds, otherComponentTypeIds + componentCount);
+		}
+
+		typeQueryList query;
+		std::vector<typeId> componentTypeIds;	// the component arrays to hand out, in the order of the view
+		uint64_t removedChunkCount = 0;		// views check it in debug builds, a removal moves the chunks they index
+	};
+
+	template<size_t ComponentCount>
+	struct CachedQuery : CachedQueryBase
+	{
+		using CachedQueryBase::CachedQueryBase;
+
+		void addChunk(Chunk* chunk) override
+		{
+			auto& queriedChunk = chunks.emplace_back();
+			queriedChunk.chunk = chunk;
+			queriedChunk.buffers[0] = chunk->getBuffer();
+			for (size_t i = 0; i < ComponentCount; i++)
+				queriedChunk.buffers[i + 1] = chunk->getArray(componentTypeIds[i]);
+		}
+
+		void removeChunk(Chunk* chunk) override
+		{
+			// the order of the chunks doesn't matter, the last one takes the place of the removed one
+			auto it = std::find_if(chunks.begin(), chunks.end(), [&](const QueriedChunk<ComponentCount>& queriedChunk) { return queriedChunk.chunk == chunk; });
+			if (it != chunks.end())
+			{
+				*it = chunks.back();
+				chunks.pop_back();
+				removedChunkCount++;
+			}
+		}
+
+		void clearChunks() override
+		{
+			chunks.clear();
+			removedChunkCount++;
+		}
+
+		std::vector<QueriedChunk<ComponentCount>> chunks;	// can contain empty chunks, check the size of the chunk
+	};
+}
@@ -1,17 +1,122 @@
 #pragma once
 #include "view.h"
+#include "task_arena.h"
 #include "ftl/atomic_counter.h"
 #include "ftl/task_scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <functional>
+#include <initializer_list>
+#include <typeinfo>
 
 namespace ecs
 {
+	// The measured time per entity of a job, a moving average over its tasks.
+	// JOB_SCHEDULE keeps one per call site, so jobs with the same variable name in different systems don't share it.
+	struct JobCost
+	{
+		void record(int entityCount, double nanoseconds)
+		{
+			float sample = float(nanoseconds / entityCount);
+			float average = nanosecondsPerEntity.load();
+			nanosecondsPerEntity.store(average > 0.0f ? average * 0.9f + sample * 0.1f : sample);	// a lost update from a concurrent task doesn't matter
+		}
+
+		std::atomic<float> nanosecondsPerEntity = 0.0f;	// zero until measured
+	};
+
+	// The task argument of a job, the entities from firstEntityIndex in the first chunk to endEntityIndex in the last one
+	template<class Fn, class... Ts>
+	struct JobTask
+	{
+		View<Ts...>* view;
+		Fn* job;
+		const char* name;
+		JobCost* cost;		// only set when the task sizes are tuned
+		int entityCount;
+		int firstChunkIndex;
+		int firstEntityIndex;
+		int lastChunkIndex;
+		int endEntityIndex;
+	};
+
+	// The task counter of a running job. The scheduler pools them and reuses them in the next frame,
+	// so a counter outlives its job and the launch tasks of later jobs can still wait on it.
+	struct JobCounter
+	{
+		JobCounter(ftl::TaskScheduler* taskScheduler, size_t fiberSlots)
+			: taskScheduler(taskScheduler)
+			, counter(taskScheduler, 0, fiberSlots)
+		{
+		}
+
+		// Waits on the fiber of the system, which has a slot on every counter of its jobs
+		void wait()
+		{
+			if (counter.Load())
+				taskScheduler->WaitForCounter(&counter, 0);
+		}
+
+		ftl::TaskScheduler* taskScheduler;
+		ftl::AtomicCounter counter;
+		std::atomic<int> dependentCount = 0;	// the jobs scheduled after it, each parks a launch fiber on the counter
+	};
+
+	// The tasks of scheduled jobs, to wait for them or to start later jobs after them.
+	// The counters live until the end of the frame, so a handle can outlive its jobs, but it is only meaningful in the frame that scheduled them.
+	struct JobHandle
+	{
+		static constexpr int maxCounterCount = 8;
+
+		static JobHandle combine(std::initializer_list<JobHandle> handles)
+		{
+			JobHandle combined;
+			for (const JobHandle& handle : handles)
+				combined.add(handle);
+			return combined;
+		}
+
+		void add(const JobHandle& handle)
+		{
+			for (int i = 0; i < handle.counterCount; i++)
+				addCounter(handle.counters[i]);
+		}
+
+		void addCounter(JobCounter* counter)
+		{
+			if (counterCount == maxCounterCount)
+			{
+				// a full handle waits for its jobs, a job that is done doesn't need to be in it
+				for (int i = 0; i < counterCount; i++)
+					counters[i]->wait();
+				counterCount = 0;
+			}
+			counters[counterCount++] = counter;
+		}
+
+		bool isDone() const
+		{
+			return std::all_of(counters.begin(), counters.begin() + counterCount, [](JobCounter* counter) { return counter->counter.Load() == 0; });
+		}
+
+		std::array<JobCounter*, maxCounterCount> counters;
+		int counterCount = 0;	// zero for jobs that ran single threaded
+	};
+
 	struct Scheduler
 	{
 		Scheduler(Ecs* ecs)
 			: ecs(ecs)
 		{
 			taskScheduler.Init({ 400, 0, ftl::EmptyQueueBehavior::Spin });
+			ecs->setTaskScheduler(&taskScheduler);
+		}
+
+		~Scheduler()
+		{
+			if (ecs->getTaskScheduler() == &taskScheduler)
+				ecs->setTaskScheduler(nullptr);
 		}
 
 		template<class Fn, class... Ts>
@@ -19,59 +124,202 @@ namespace ecs
 		{
 			auto fn = [](ftl::TaskScheduler* taskScheduler, void* arg) -> void
 			{
-				auto tuple = reinterpret_cast<std::tuple<View<Ts...>*, int, Fn*, const char*>*>(arg);
-				auto view = std::get<0>(*tuple);
-				auto iChunk = std::get<1>(*tuple);
-				auto job = std::get<2>(*tuple);
-				auto name = std::get<3>(*tuple);
+				auto& task = *reinterpret_cast<JobTask<Fn, Ts...>*>(arg);
+
+				char blockName[64];
+				sprintf_s(blockName, "Task MT %s", task.name);
+				EASY_NONSCOPED_BLOCK(blockName);
+
+				auto start = task.cost ? std::chrono::high_resolution_clock::now() : std::chrono::high_resolution_clock::time_point();
+				auto queriedChunks = task.view->getQueriedChunks();
+				for (int iChunk = task.firstChunkIndex; iChunk <= task.lastChunkIndex; iChunk++)
+				{
+					int firstEntityIndex = iChunk == task.firstChunkIndex ? task.firstEntityIndex : 0;
+					int endEntityIndex = iChunk == task.lastChunkIndex ? task.endEntityIndex : queriedChunks[iChunk].chunk->size;
+					for (auto it = task.view->beginForChunk(iChunk, firstEntityIndex, endEntityIndex); it != task.view->endForChunk(); ++it)
+					{
+						(*task.job)(it);
+					}
+				}
+
+				if (task.cost)
+					task.cost->record(task.entityCount, std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count());
+
+				EASY_END_BLOCK;
+			};
+
+			return fn;
+		}
+
+		// The task function of a ChunkJob, the kernel gets the entity range of every chunk in one call
+		template<class Fn, class... Ts>
+		static ftl::TaskFunction createChunkTaskFunction()
+		{
+			auto fn = [](ftl::TaskScheduler* taskScheduler, void* arg) -> void
+			{
+				auto& task = *reinterpret_cast<JobTask<Fn, Ts...>*>(arg);
 
 				char blockName[64];
-				sprintf_s(blockName, "Task MT %s", name);
+				sprintf_s(blockName, "Chunk task MT %s", task.name);
 				EASY_NONSCOPED_BLOCK(blockName);
 
-				for (auto it = view->beginForChunk(iChunk); it != view->endForChunk(); ++it)
+				auto start = task.cost ? std::chrono::high_resolution_clock::now() : std::chrono::high_resolution_clock::time_point();
+				auto queriedChunks = task.view->getQueriedChunks();
+				for (int iChunk = task.firstChunkIndex; iChunk <= task.lastChunkIndex; iChunk++)
 				{
-					(*job)(it);
+					int firstEntityIndex = iChunk == task.firstChunkIndex ? task.firstEntityIndex : 0;
+					int endEntityIndex = iChunk == task.lastChunkIndex ? task.endEntityIndex : queriedChunks[iChunk].chunk->size;
+					// only the task with the start of a split chunk stamps it, the others would race on the versions
+					if (firstEntityIndex == 0 && endEntityIndex > 0)
+						task.view->markWrittenArraysChanged(queriedChunks[iChunk].chunk);
+					View<Ts...>::callForSlice(*task.job, queriedChunks[iChunk], firstEntityIndex, endEntityIndex - firstEntityIndex, std::index_sequence_for<Ts...>());
 				}
 
+				if (task.cost)
+					task.cost->record(task.entityCount, std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count());
+
 				EASY_END_BLOCK;
 			};
 
 			return fn;
 		}
 
+		// Systems stay registered and run every frame until they are removed
 		template<class TSystem>
-		int scheduleSystem(int systemGroupIndex = -1);
-		void runSystems(bool waitAll = true);
+		TSystem* addSystem();
+		void removeSystem(struct System* system);
+		void runSystems();
+
+		// Builds the stages and tasks of the systems. runSystems calls it when the system set changed since the last compile.
+		// A system goes to the stage after the last stage of the earlier systems it conflicts with, the systems of a stage run concurrently.
+		void compilePipeline();
+#ifdef _DEBUG
+		void lockSystemTypes(struct System* system);
+		void releaseSystemTypes(struct System* system);
+#endif
+
+		// Adds the tasks of a job when its dependencies are done, without waiting for anything.
+		// With running dependencies a launch task waits for them on its own fiber and adds the job tasks to the same counter, so the counter covers both.
+		template <class Fn, class... Ts>
+		void launchJob(ftl::AtomicCounter* counter, View<Ts...>* view, Fn* job, const char* name, JobCost* cost, ftl::TaskFunction taskFunction, const JobHandle& dependencies)
+		{
+			if (dependencies.isDone())
+			{
+				addTask(counter, view, job, name, cost, taskFunction);
+				return;
+			}
+
+			struct LaunchArg
+			{
+				Scheduler* scheduler;
+				ftl::AtomicCounter* counter;
+				View<Ts...>* view;
+				Fn* job;
+				const char* name;
+				JobCost* cost;
+				ftl::TaskFunction taskFunction;
+				JobCounter** dependencies;
+				int dependencyCount;
+			};
+
+			auto launch = [](ftl::TaskScheduler* taskScheduler, void* arg)
+			{
+				auto& launchArg = *reinterpret_cast<LaunchArg*>(arg);
+				for (int i = 0; i < launchArg.dependencyCount; i++)
+				{
+					launchArg.scheduler->waitCounter(&launchArg.dependencies[i]->counter);
+				}
+				launchArg.scheduler->addTask(launchArg.counter, launchArg.view, launchArg.job, launchArg.name, launchArg.cost, launchArg.taskFunction);
+			};
+
+			// The launch task parks a fiber on every running dependency. A counter has room for the fiber of the system and jobCounterFiberSlots - 1 launch tasks,
+			// a fiber that doesn't get a slot would never wake up. Past that the system waits for the dependencies itself and adds the tasks right away.
+			int dependencyCount = dependencies.counterCount;
+			int reservedCount = 0;
+			while (reservedCount < dependencyCount && dependencies.counters[reservedCount]->dependentCount.fetch_add(1) + 1 < (int)jobCounterFiberSlots)
+				reservedCount++;
+			if (reservedCount < dependencyCount)
+			{
+				_ASSERT_EXPR(false, L"Too many jobs are scheduled after the same job, raise Scheduler::jobCounterFiberSlots!");
+				for (int i = 0; i <= reservedCount; i++)
+					dependencies.counters[i]->dependentCount--;
+				for (int i = 0; i < dependencyCount; i++)
+					dependencies.counters[i]->wait();
+				addTask(counter, view, job, name, cost, taskFunction);
+				return;
+			}
 
+			// the handle is gone by the time the launch task runs, the counters are copied next to the argument
+			auto dependencyCounters = reinterpret_cast<JobCounter**>(taskArena.allocate(dependencyCount * sizeof(JobCounter*), alignof(JobCounter*)));
+			std::copy(dependencies.counters.begin(), dependencies.counters.begin() + dependencyCount, dependencyCounters);
+			ftl::Task task{ launch, taskArena.create<LaunchArg>(this, counter, view, job, name, cost, taskFunction, dependencyCounters, dependencyCount) };
+			taskScheduler.AddTasks(1, &task, counter);
+		}
+
+		// Cuts the entities of the view into tasks of about getTaskEntityCount entities.
+		// A task can span several small chunks or a part of a big one. taskFunction is createTaskFunction or createChunkTaskFunction of Fn.
+		// cost is the measured cost of the job's call site, nullptr leaves the task size at targetTaskEntityCount.
 		template <class Fn, class... Ts>
-		void addTask(ftl::AtomicCounter* counter, View<Ts...>* view, Fn* job, const char* name)		// Called from a fiber
+		void addTask(ftl::AtomicCounter* counter, View<Ts...>* view, Fn* job, const char* name, JobCost* cost, ftl::TaskFunction taskFunction)		// Called from a fiber
 		{
-			view->initializeData();
-			int chunkCount = (int)view->queriedChunks_.size();
-			if (!chunkCount)
+			int entityCount = (int)view->getCount();
+			if (!entityCount)
 				return;
 
+			EASY_BLOCK("Adding job tasks");
+			if (!autoTuneTaskSize)
+				cost = nullptr;
+			int taskEntityCount = getTaskEntityCount(entityCount, cost);
+			// a task only ends early at the end of the view, the array lives in the arena like the task arguments
+			int maxTaskCount = (entityCount + taskEntityCount - 1) / taskEntityCount;
+			auto tasks = reinterpret_cast<ftl::Task*>(taskArena.allocate(maxTaskCount * sizeof(ftl::Task), alignof(ftl::Task)));
+			int taskCount = 0;
+
+			auto queriedChunks = view->getQueriedChunks();
+			JobTask<Fn, Ts...> task{ view, job, name, cost };
+			task.entityCount = 0;
+			for (int iChunk = 0; iChunk < (int)queriedChunks.size(); iChunk++)
 			{
-				EASY_BLOCK("Adding chunk tasks");
-				std::vector<ftl::Task> tasks(chunkCount);
-				for (int i = 0; i < chunkCount; i++)
+				int chunkSize = queriedChunks[iChunk].chunk->size;
+				int entityIndex = 0;
+				while (entityIndex < chunkSize)
 				{
-					auto argTuple = std::make_tuple(view, i, job, name);
-					int bufferIndex = currentBufferIndex.fetch_add(sizeof(argTuple));
-					if (bufferIndex == 0)
+					if (task.entityCount == 0)
 					{
-						printf("Buffer index for jobs is 0.");
+						task.firstChunkIndex = iChunk;
+						task.firstEntityIndex = entityIndex;
 					}
-					uint8_t* buffer = &argBuffer[bufferIndex];
-					memcpy(buffer, &argTuple, sizeof(argTuple));
 
-					tasks[i].ArgData = buffer;
-					tasks[i].Function = Scheduler::createTaskFunction<Fn, Ts...>();
+					int takenCount = std::min(chunkSize - entityIndex, taskEntityCount - task.entityCount);
+					entityIndex += takenCount;
+					task.entityCount += takenCount;
+					task.lastChunkIndex = iChunk;
+					task.endEntityIndex = entityIndex;
+					if (task.entityCount == taskEntityCount)
+					{
+						tasks[taskCount++] = { taskFunction, taskArena.create<JobTask<Fn, Ts...>>(task) };
+						task.entityCount = 0;
+					}
 				}
-				//printf("\t<%d\n", counterIndex);
-				taskScheduler.AddTasks(chunkCount, tasks.data(), counter);
 			}
+
+			if (task.entityCount > 0)
+				tasks[taskCount++] = { taskFunction, taskArena.create<JobTask<Fn, Ts...>>(task) };
+
+			taskScheduler.AddTasks((unsigned)taskCount, tasks, counter);
+		}
+
+		// The target task size, but small views still get a task per thread
+		int getTaskEntityCount(int entityCount, const JobCost* cost) const
+		{
+			int taskEntityCount = targetTaskEntityCount;
+			float nanosecondsPerEntity = cost ? cost->nanosecondsPerEntity.load() : 0.0f;
+			if (nanosecondsPerEntity > 0.0f)
+				taskEntityCount = (int)std::min(targetTaskMicroseconds * 1000.0f / nanosecondsPerEntity, (float)INT_MAX);
+
+			int threadCount = (int)taskScheduler.GetThreadCount();
+			taskEntityCount = std::min(taskEntityCount, (entityCount + threadCount - 1) / threadCount);
+			return std::max(taskEntityCount, minTaskEntityCount);
 		}
 
 		void waitCounter(ftl::AtomicCounter* counter, bool fromMainThread = false)
@@ -90,20 +338,86 @@ namespace ecs
 		Ecs* ecs;
 		ftl::TaskScheduler taskScheduler;
 
-		std::mutex argBufferMutex;
-		std::array<uint8_t, (1 << 20)> argBuffer; // 1 MB
-		std::atomic<int> currentBufferIndex = 0;
-		int currentSystemGroupIndex = 0;
+		TaskArena taskArena;	// the task arguments of the current frame
+
+		// Fibers that can wait for one job at the same time, the launch task of every job scheduled after it and the fiber of its system.
+		// So jobCounterFiberSlots - 1 jobs can be scheduled after the same job, launchJob asserts it and makes the system wait for the dependencies of any further job.
+		static constexpr size_t jobCounterFiberSlots = 16;
+
+		// A zeroed counter for a job, valid until the end of the frame. Called from the system tasks in parallel.
+		JobCounter* acquireJobCounter()
+		{
+			std::lock_guard<std::mutex> lock(jobCounterMutex);
+			if (usedJobCounterCount == jobCounters.size())
+				jobCounters.push_back(std::make_unique<JobCounter>(&taskScheduler, jobCounterFiberSlots));
+
+			JobCounter* counter = jobCounters[usedJobCounterCount++].get();
+			counter->dependentCount = 0;
+			return counter;
+		}
+
+		std::mutex jobCounterMutex;
+		std::vector<std::unique_ptr<JobCounter>> jobCounters;	// pooled, only grows
+		size_t usedJobCounterCount = 0;		// by the jobs of the current frame
+
+		// Task granularity of the jobs. With autoTuneTaskSize the tasks are sized to take targetTaskMicroseconds by the measured cost of the job.
+		int targetTaskEntityCount = 1024;
+		int minTaskEntityCount = 64;
+		bool autoTuneTaskSize = false;
+		float targetTaskMicroseconds = 50.0f;
 
 		std::vector<std::unique_ptr<struct System>> systems;
 		bool singleThreadedMode = false;
+
+		// The compiled pipeline, reused every frame
+		bool pipelineDirty = false;
+		std::vector<int> systemStages;		// indexed like systems
+		std::vector<std::tuple<Scheduler*, int>> systemTaskArgs;	// indexed like systems
+		std::vector<ftl::Task> systemTasks;		// ordered by stage
+		std::vector<int> stageFirstTasks;		// the first task of every stage in systemTasks and the end of the last one
+		std::vector<std::unique_ptr<ftl::AtomicCounter>> stageCounters;	// pooled, only grows
 	};
 
 	enum class JobState { None, Running, Done };
 
+	// What Job and ChunkJob share, the counter of their tasks while they run
+	struct JobBase
+	{
+		JobBase() = default;
+		JobBase(const JobBase&) = delete;
+		JobBase& operator=(const JobBase&) = delete;
+
+		JobHandle getHandle()
+		{
+			JobHandle handle;
+			if (state == JobState::Running)
+				handle.addCounter(counter);
+			return handle;
+		}
+
+		// The jobs call it in their destructor, while their view and function are still there for the tasks
+		void finish()
+		{
+			if (state == JobState::Running)
+			{
+				scheduler->waitCounter(&counter->counter);
+				state = JobState::Done;
+			}
+
+			if (state != JobState::Done)
+			{
+				printf("Job destructor before finishing!");
+			}
+		}
+
+		Scheduler* scheduler = nullptr;
+		JobCounter* counter = nullptr;	// taken from the scheduler's pool when the job is scheduled
+		JobState state = JobState::None;
+	};
+
 
 	template<class... Ts>
-	struct Job
+	struct Job : JobBase
 	{
 		using Arg = View<Ts...>::iterator<true>;
 
@@ -114,31 +428,100 @@ namespace ecs
 
 		~Job()
 		{
-			if (state != JobState::Done)
-			{
-				printf("Job destructor before finishing!");
-			}
+			finish();
 		}
 
 		std::function<void(const Arg&)> fn;
 		View<Ts...> view;
-		JobState state = JobState::None;
 	};
 
+	// A job whose kernel gets whole chunks: fn(int entityCount, const entityId* entityIds, Ts*... components), like View::forEachChunk.
+	// The kernel type is a template argument instead of a std::function, so the loop over the entities inlines into the task and can be vectorized.
+	// A chunk can be split between tasks, then the kernel gets a part of it.
+	template<class Fn, class... Ts>
+	struct ChunkJob : JobBase
+	{
+		ChunkJob(View<Ts...>&& view, Fn fn)
+			: fn(std::move(fn))
+			, view(std::move(view))
+		{
+		}
+
+		~ChunkJob()
+		{
+			finish();
+		}
+
+		Fn fn;
+		View<Ts...> view;
+	};
+
+// The function captures by reference, so whatever it uses has to be declared before the job: the job destructor waits for the tasks, so they can't outlive it
 #define JOB_SET_FN(jobVariable) jobVariable.fn = [&](const decltype(jobVariable)::Arg& it)
-#define JOB_SCHEDULE(jobVariable) scheduleJob(jobVariable, #jobVariable)
+// The lambda gives every call site its own JobCost
+#define JOB_COST_OF_CALL_SITE() ([]() -> ecs::JobCost* { static ecs::JobCost cost; return &cost; }())
+#define JOB_SCHEDULE(jobVariable) scheduleJob(jobVariable, #jobVariable, {}, JOB_COST_OF_CALL_SITE())
+#define JOB_SCHEDULE_AFTER(jobVariable, dependencies) scheduleJob(jobVariable, #jobVariable, dependencies, JOB_COST_OF_CALL_SITE())
 
 	struct System
 	{
+		virtual ~System() = default;
 		virtual void scheduleJobs(ecs::Ecs* ecs) = 0;
 
+		// Declare the components of every job here with declareQuery, the scheduler builds the system order from them.
+		// A system that declares nothing is ordered against every other system.
+		virtual void declareQueries() {}
+
+		// Two systems conflict if one of them writes a component the other one reads or writes
+		bool conflictsWith(const System& other) const
+		{
+			if (!hasDeclaredQueries || !other.hasDeclaredQueries)
+				return true;
+
+			return writeTypes.hasAnyType(other.readTypes) || writeTypes.hasAnyType(other.writeTypes) || readTypes.hasAnyType(other.writeTypes);
+		}
+
 		template<class... Ts>
-		void scheduleJob(Job<Ts...>& job, const char* name = "")
+		void declareQuery()
+		{
+			readTypes.addTypes(ecs->getTypeIds_FilterConst<Ts...>(true));
+			writeTypes.addTypes(ecs->getTypeIds_FilterConst<Ts...>(false));
+			hasDeclaredQueries = true;
+		}
+
+#ifdef _DEBUG
+		// A job using components the system didn't declare can run next to a conflicting system
+		void reportUndeclaredAccess(const typeQueryList& query, const char* jobName) const
 		{
+			if (!hasDeclaredQueries)
+				return;
+
+			typeIdList undeclaredTypes = query.write;
+			undeclaredTypes.deleteTypes(writeTypes);
+			typeIdList undeclaredReadTypes = query.read;
+			undeclaredReadTypes.deleteTypes(readTypes);
+			undeclaredReadTypes.deleteTypes(writeTypes);
+			undeclaredTypes.addTypes(undeclaredReadTypes);
+			undeclaredTypes.forEachTypeIndex([&](int typeIndex)
+				{
+					printf("Job %s of system %s uses %s without declaring it.\n", jobName, typeid(*this).name(), ecs->typeIds_[typeIndex]->name.c_str());
+				});
+			_ASSERT_EXPR(undeclaredTypes.isEmpty(), L"The job uses components the system didn't declare in declareQueries!");
+		}
+#endif
+
+		// Starts the tasks of the job and returns without waiting for them, the tasks wait for the dependencies first.
+		// A job waits for its tasks when it gets destroyed, so the jobs of a system overlap and are all done by the end of scheduleJobs.
+		template<class... Ts>
+		JobHandle scheduleJob(Job<Ts...>& job, const char* name = "", const JobHandle& dependencies = {}, JobCost* cost = nullptr)
+		{
+#ifdef _DEBUG
+			reportUndeclaredAccess(job.view.typeQueryList, name);
+#endif
 			if (scheduler->singleThreadedMode)
 			{
-				job.view.initializeData();
-				int chunkCount = (int)job.view.queriedChunks_.size();
+				// the jobs run in the order they are scheduled, the dependencies are already done
+				int chunkCount = job.view.getChunkCount();
 
 				for (int iChunk = 0; iChunk < chunkCount; iChunk++)
 				{
@@ -148,102 +531,207 @@ namespace ecs
 					}
 				}
 				job.state = JobState::Done;
-				return;
+				return {};
+			}
+
+			return startJob(job, &job.view, &job.fn, name, cost, Scheduler::createTaskFunction<decltype(job.fn), Ts...>(), dependencies);
+		}
+
+		template<class Fn, class... Ts>
+		JobHandle scheduleJob(ChunkJob<Fn, Ts...>& job, const char* name = "", const JobHandle& dependencies = {}, JobCost* cost = nullptr)
+		{
+#ifdef _DEBUG
+			reportUndeclaredAccess(job.view.typeQueryList, name);
+#endif
+			_ASSERT_EXPR(!job.view.hasFieldByFieldComponents(), L"Components stored field by field have no struct arrays, use getFieldSpan!");
+			if (scheduler->singleThreadedMode)
+			{
+				job.view.forEachChunk(job.fn);
+				job.state = JobState::Done;
+				return {};
 			}
 
+			return startJob(job, &job.view, &job.fn, name, cost, Scheduler::createChunkTaskFunction<Fn, Ts...>(), dependencies);
+		}
+
+		template<class Fn, class... Ts>
+		JobHandle startJob(JobBase& job, View<Ts...>* view, Fn* fn, const char* name, JobCost* cost, ftl::TaskFunction taskFunction, const JobHandle& dependencies)
+		{
+			_ASSERT_EXPR(job.state != JobState::Running, L"The job is scheduled again before it finished!");
+			job.scheduler = scheduler;
+			job.counter = scheduler->acquireJobCounter();
 			job.state = JobState::Running;
-			ftl::AtomicCounter counter(&scheduler->taskScheduler);
-			scheduler->addTask(&counter, &job.view, &job.fn, name);
-			scheduler->waitCounter(&counter);
-			job.state = JobState::Done;
+			scheduler->launchJob(&job.counter->counter, view, fn, name, cost, taskFunction, dependencies);
+			return job.getHandle();
+		}
+
+		// Only needed when the results are used before the end of scheduleJobs
+		void waitForJobs(const JobHandle& handle)
+		{
+			for (int i = 0; i < handle.counterCount; i++)
+			{
+				handle.counters[i]->wait();
+			}
 		}
 
 		Ecs* ecs;
 		Scheduler* scheduler;
-		int systemGroupIndex;
+		typeIdList readTypes = typeIdList(0, {});
+		typeIdList writeTypes = typeIdList(0, {});
+		bool hasDeclaredQueries = false;
+#ifdef _DEBUG
+		std::vector<typeId> lockedForRead;
+		std::vector<typeId> lockedForWrite;
+#endif
 	};
 
 	template<class TSystem>
-	int Scheduler::scheduleSystem(int systemGroupIndex)
+	TSystem* Scheduler::addSystem()
 	{
-		auto& systemPtr = systems.emplace_back(std::make_unique<TSystem>());
-		System* system = systemPtr.get();
-
-		if (systemGroupIndex < 0)
-			systemGroupIndex = currentSystemGroupIndex++;
-
+		auto systemPtr = std::make_unique<TSystem>();
+		TSystem* system = systemPtr.get();
 		system->ecs = ecs;
 		system->scheduler = this;
-		system->systemGroupIndex = systemGroupIndex;
+		system->declareQueries();
 
-		return systemGroupIndex;
+		systems.push_back(std::move(systemPtr));
+		pipelineDirty = true;
+		return system;
 	}
 
-//#pragma optimize("", off)
-	void Scheduler::runSystems(bool wait)
+	void Scheduler::removeSystem(System* system)
 	{
-		if (singleThreadedMode)
+		auto it = std::find_if(systems.begin(), systems.end(), [&](auto& systemPtr) { return systemPtr.get() == system; });
+		if (it != systems.end())
 		{
-			for (auto& system : systems)
-			{
-				system->scheduleJobs(ecs);
-			}
-
-			return;
+			systems.erase(it);
+			pipelineDirty = true;
 		}
+	}
 
-		auto fnWrapperTask = [](ftl::TaskScheduler* taskScheduler, void* args)
+	void Scheduler::compilePipeline()
+	{
+		auto fnSystemTask = [](ftl::TaskScheduler* taskScheduler, void* args)
 		{
-			auto& [scheduler, systemGroupIndex] = *reinterpret_cast<std::tuple<Scheduler*, int>*>(args);
-			for (auto& system : scheduler->systems)
-			{
-				if (system->systemGroupIndex == systemGroupIndex)
-				{
-					system->scheduleJobs(scheduler->ecs);
-				}
-			}
-		};
-
-		std::vector<int> uniqueGroupIndices;
-		ftl::AtomicCounter groupCounters[] = {
-			ftl::AtomicCounter(&taskScheduler), ftl::AtomicCounter(&taskScheduler),
-			ftl::AtomicCounter(&taskScheduler), ftl::AtomicCounter(&taskScheduler)
+			auto& [scheduler, systemIndex] = *reinterpret_cast<std::tuple<Scheduler*, int>*>(args);
+			System* system = scheduler->systems[systemIndex].get();
+#ifdef _DEBUG
+			scheduler->lockSystemTypes(system);
+#endif
+			system->scheduleJobs(scheduler->ecs);
+#ifdef _DEBUG
+			scheduler->releaseSystemTypes(system);
+#endif
 		};
 
-		for (auto& system : systems)
+		int systemCount = (int)systems.size();
+		int stageCount = 0;
+		systemStages.assign(systemCount, 0);
+		for (int iSystem = 0; iSystem < systemCount; iSystem++)
 		{
-			auto it = std::find(uniqueGroupIndices.begin(), uniqueGroupIndices.end(), system->systemGroupIndex);
-			if (it == uniqueGroupIndices.end())
+			System* system = systems[iSystem].get();
+			int stage = 0;
+			for (int iEarlier = 0; iEarlier < iSystem; iEarlier++)
 			{
-				uniqueGroupIndices.push_back(system->systemGroupIndex);
+				if (system->conflictsWith(*systems[iEarlier]))
+					stage = std::max(stage, systemStages[iEarlier] + 1);
 			}
+			systemStages[iSystem] = stage;
+			stageCount = std::max(stageCount, stage + 1);
 		}
 
-		int iGroup = 0;
-		for (int groupIndex : uniqueGroupIndices)
+		// counting sort of the tasks by stage, the registration order stays within a stage
+		stageFirstTasks.assign(stageCount + 1, 0);
+		for (int stage : systemStages)
+			stageFirstTasks[stage + 1]++;
+		for (int iStage = 0; iStage < stageCount; iStage++)
+			stageFirstTasks[iStage + 1] += stageFirstTasks[iStage];
+
+		std::vector<int> nextTaskInStage(stageFirstTasks.begin(), stageFirstTasks.end() - 1);
+		systemTaskArgs.resize(systemCount);
+		systemTasks.resize(systemCount);
+		for (int iSystem = 0; iSystem < systemCount; iSystem++)
 		{
-			auto argTuple = std::make_tuple(this, groupIndex);
-			int bufferIndex = currentBufferIndex.fetch_add(sizeof(argTuple));
-			uint8_t* buffer = &argBuffer[bufferIndex];
-			memcpy(buffer, &argTuple, sizeof(argTuple));
-
-			ftl::Task task;
-			task.ArgData = buffer;
-			task.Function = fnWrapperTask;
-			//printf("<%d\n", groupIndex);
-			taskScheduler.AddTasks(1, &task, &groupCounters[iGroup]);
-			iGroup++;
+			systemTaskArgs[iSystem] = std::make_tuple(this, iSystem);
+			ftl::Task& task = systemTasks[nextTaskInStage[systemStages[iSystem]]++];
+			task.ArgData = &systemTaskArgs[iSystem];
+			task.Function = fnSystemTask;
 		}
 
-		for (auto& groupCounter : groupCounters)
+		// the counters are all zero between frames, the existing ones are reused
+		while ((int)stageCounters.size() < stageCount)
+			stageCounters.push_back(std::make_unique<ftl::AtomicCounter>(&taskScheduler));
+
+		pipelineDirty = false;
+	}
+
+#ifdef _DEBUG
+	// The stages keep conflicting systems apart, so a failing lock means something else runs next to the system with conflicting access
+	void Scheduler::lockSystemTypes(System* system)
+	{
+		system->readTypes.forEachTypeIndex([&](int typeIndex)
+			{
+				typeId t = ecs->typeIds_[typeIndex];
+				if (ecs->lockTypeForRead(t))
+					system->lockedForRead.push_back(t);
+				else
+					printf("System %s reads %s while it is written by something else.\n", typeid(*system).name(), t->name.c_str());
+			});
+
+		system->writeTypes.forEachTypeIndex([&](int typeIndex)
+			{
+				typeId t = ecs->typeIds_[typeIndex];
+				if (ecs->lockTypeForWrite(t))
+					system->lockedForWrite.push_back(t);
+				else
+					printf("System %s writes %s while it is used by something else.\n", typeid(*system).name(), t->name.c_str());
+			});
+	}
+
+	void Scheduler::releaseSystemTypes(System* system)
+	{
+		for (typeId t : system->lockedForRead)
+			ecs->releaseTypeForRead(t);
+		for (typeId t : system->lockedForWrite)
+			ecs->releaseTypeForWrite(t);
+		system->lockedForRead.clear();
+		system->lockedForWrite.clear();
+	}
+#endif
+
+//#pragma optimize("", off)
+	void Scheduler::runSystems()
+	{
+		if (pipelineDirty)
+			compilePipeline();
+
+		if (singleThreadedMode)
+		{
+			// the registration order satisfies every dependency
+			for (auto& system : systems)
+			{
+				system->scheduleJobs(ecs);
+			}
+		}
+		else
 		{
-			waitCounter(&groupCounter, true);
+			// a stage starts when the previous one is done, its systems don't conflict with each other
+			for (int iStage = 0; iStage + 1 < (int)stageFirstTasks.size(); iStage++)
+			{
+				int firstTask = stageFirstTasks[iStage];
+				int taskCount = stageFirstTasks[iStage + 1] - firstTask;
+				taskScheduler.AddTasks(taskCount, &systemTasks[firstTask], stageCounters[iStage].get());
+				waitCounter(stageCounters[iStage].get(), true);
+			}
 		}
 
-		currentSystemGroupIndex = 0;
-		currentBufferIndex = 0;
-
-		systems.clear();
+		// the jobs finished with their systems, unless one outlived its system. Its tasks still use the arena.
+		for (size_t i = 0; i < usedJobCounterCount; i++)
+			waitCounter(&jobCounters[i]->counter, true);
+		taskArena.reset();
+		usedJobCounterCount = 0;
+		// every system has seen the events, the command buffer records the ones for the next frame
+		ecs->clearComponentEvents();
 		ecs->executeCommmandBuffer();
 	}
 //#pragma optimize("", on)
@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace ecs
+{
+	// A linear arena for the arguments of the tasks of a frame.
+	// Allocating is a single atomic add in the current block. When the block runs out, the next one is taken under a lock, a new block only gets allocated when every block is used.
+	// reset() makes the whole arena reusable at the end of the frame, the blocks are kept for the next frames.
+	// Thread safe except for reset.
+	struct TaskArena
+	{
+		static inline const size_t defaultBlockSize = 1 << 16;	// 64KB
+
+		struct Stats
+		{
+			size_t blockCount = 0;
+			size_t reservedBytes = 0;		// the size of all the blocks
+			size_t frameBytes = 0;			// allocated since the last reset, with the alignment padding
+			size_t highWaterMark = 0;		// the most bytes a frame allocated
+			size_t allocationCount = 0;		// since the arena was created
+		};
+
+		TaskArena(size_t blockSize = defaultBlockSize)
+			: blockSize(blockSize)
+		{
+			addBlock(blockSize);
+			currentBlock = blocks[0].get();
+		}
+
+		TaskArena(const TaskArena&) = delete;
+		TaskArena& operator=(const TaskArena&) = delete;
+
+		// The arena doesn't call destructors, so the payload can't own anything
+		template<class T, class... Args>
+		T* create(Args&&... args)
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "Task arguments are never destroyed, they can't own resources!");
+			void* memory = allocate(sizeof(T), alignof(T));
+			return new (memory) T{ std::forward<Args>(args)... };
+		}
+
+		void* allocate(size_t size, size_t alignment)
+		{
+			size_t paddedSize = size + alignment - 1;
+			frameBytes.fetch_add(paddedSize, std::memory_order_relaxed);
+			allocationCount.fetch_add(1, std::memory_order_relaxed);
+			while (true)
+			{
+				Block* block = currentBlock.load(std::memory_order_acquire);
+				size_t offset = block->used.fetch_add(paddedSize, std::memory_order_relaxed);
+				if (offset + paddedSize <= block->size)
+				{
+					uintptr_t address = (uintptr_t)block->memory.get() + offset;
+					return (void*)((address + alignment - 1) / alignment * alignment);
+				}
+
+				// The block is full. Whoever gets the lock first moves on to the next block, the others retry in it.
+				std::lock_guard<std::mutex> lock(growMutex);
+				if (currentBlock.load(std::memory_order_relaxed) == block)
+				{
+					size_t nextIndex = block->index + 1;
+					while (nextIndex < blocks.size() && blocks[nextIndex]->size < paddedSize)
+						nextIndex++;
+					if (nextIndex == blocks.size())
+						addBlock(std::max(blockSize, paddedSize));
+
+					currentBlock.store(blocks[nextIndex].get(), std::memory_order_release);
+				}
+			}
+		}
+
+		// Call it when no task of the frame can read its arguments anymore
+		void reset()
+		{
+			size_t bytes = frameBytes.exchange(0);
+			highWaterMark = std::max(highWaterMark, bytes);
+			for (auto& block : blocks)
+				block->used = 0;
+			currentBlock = blocks[0].get();
+		}
+
+		Stats getStats() const
+		{
+			std::lock_guard<std::mutex> lock(growMutex);
+			Stats stats;
+			stats.blockCount = blocks.size();
+			for (auto& block : blocks)
+				stats.reservedBytes += block->size;
+			stats.frameBytes = frameBytes;
+			stats.highWaterMark = std::max(highWaterMark, stats.frameBytes);
+			stats.allocationCount = allocationCount;
+			return stats;
+		}
+
+	private:
+		struct Block
+		{
+			std::unique_ptr<uint8_t[]> memory;
+			size_t size;
+			size_t index;
+			std::atomic<size_t> used = 0;	// can go past the size, the allocations that did that moved on to the next block
+		};
+
+		void addBlock(size_t size)
+		{
+			auto block = std::make_unique<Block>();
+			block->memory = std::make_unique<uint8_t[]>(size);
+			block->size = size;
+			block->index = blocks.size();
+			blocks.push_back(std::move(block));
+		}
+
+		size_t blockSize;
+		std::vector<std::unique_ptr<Block>> blocks;		// guarded by growMutex after the constructor
+		std::atomic<Block*> currentBlock = nullptr;
+		mutable std::mutex growMutex;
+		std::atomic<size_t> frameBytes = 0;
+		std::atomic<size_t> allocationCount = 0;
+		size_t highWaterMark = 0;
+	};
+}
@@ -6,6 +6,7 @@
 #include "archetype_impl.h"
 #include "ecs_impl.h"
 #include "entitycommand.h"
+#include "parallel_for.h"
 
 namespace ecs
 {
@@ -52,18 +53,55 @@ namespace ecs
 		View filterShared(const C& sharedComponent)
 		{
 			initializeData();
-			for (auto it = queriedChunks_.begin(); it != queriedChunks_.end();)
+			// the cached chunk list is shared by every view of the query, the filtered one is our own copy
+			std::vector<QueriedChunk<sizeof...(Ts)>> filteredChunks;
+			for (auto& queriedChunk : getQueriedChunks())
 			{
-				Chunk* chunk = it->chunk;
-				const C* sharedValue = chunk->getSharedComponent<C>(ecs_->getTypeId<C>());
-				if (!sharedValue || !equals(*sharedValue, sharedComponent))
-					it = queriedChunks_.erase(it);
-				else
-					++it;
+				const C* sharedValue = queriedChunk.chunk->getSharedComponent<C>(ecs_->getTypeId<C>());
+				if (sharedValue && equals(*sharedValue, sharedComponent))
+					filteredChunks.push_back(queriedChunk);
+			}
+			filteredChunks_ = std::move(filteredChunks);
+			filtered_ = true;
+			return std::move(*this);
+		}
+
+		// Keeps the chunks whose C array was written at the change version or later (see Ecs::advanceChangeVersion).
+		// Whole chunks pass or fail, a passing chunk can have unchanged entities too.
+		template <class C>
+		View changedSince(uint64_t version)
+		{
+			initializeData();
+			typeId tid = ecs_->getTypeId<C>();
+			std::vector<QueriedChunk<sizeof...(Ts)>> filteredChunks;
+			for (auto& queriedChunk : getQueriedChunks())
+			{
+				int arrayIndex = queriedChunk.chunk->layout->getArrayIndex(tid);
+				if (arrayIndex >= 0 && queriedChunk.chunk->getColumnVersion(arrayIndex) >= version)
+					filteredChunks.push_back(queriedChunk);
 			}
+			filteredChunks_ = std::move(filteredChunks);
+			filtered_ = true;
 			return std::move(*this);
 		}
 
+		// Iterates the entities of the view that got a C since the events were cleared (see Ecs::trackComponentEvents).
+		// Only the added entities get touched, an unchanged world costs nothing.
+		template <class C>
+		auto added()
+		{
+			return EventRange{ std::move(*this), &ecs_->getAddedEntities<C>(), ecs_->getTypeId<C>(), true };
+		}
+
+		// Iterates the entities of the view that lost C since the events were cleared. Deleted entities are gone and are not visited.
+		template <class C>
+		auto removed()
+		{
+			return EventRange{ std::move(*this), &ecs_->getRemovedEntities<C>(), ecs_->getTypeId<C>(), false };
+		}
+
+		struct EventRange;
+
 		bool lockUsedTypes()
 		{
 			bool locksAreOk = true;
@@ -96,24 +134,91 @@ namespace ecs
 			if (!initialized_)
 			{
 				EASY_BLOCK("View Init");
-				queriedChunks_ = ecs_->get<Ts...>(typeQueryList);
+				cachedQuery_ = ecs_->getCachedQuery<Ts...>(typeQueryList);
+				cachedChunkCount_ = (int)cachedQuery_->chunks.size();
+				removedChunkCount_ = cachedQuery_->removedChunkCount;
 				initialized_ = true;
 			}
 		}
 
+		// The chunks that existed when the view was initialized. Creating entities doesn't disturb a view, deleting chunks does.
+		QueriedChunkRange<sizeof...(Ts)> getQueriedChunks() const
+		{
+			if (filtered_)
+				return { &filteredChunks_, (int)filteredChunks_.size() };
+
+			_ASSERT_EXPR(cachedQuery_->removedChunkCount == removedChunkCount_, L"Chunks of the view were deleted while it was in use, views can't be kept over deleting entities or components!");
+			return { &cachedQuery_->chunks, std::min(cachedChunkCount_, (int)cachedQuery_->chunks.size()) };
+		}
+
+		// The cached chunk lists can contain empty chunks, -1 if there are no more chunks with entities
+		int findChunkWithEntities(int firstChunkIndex) const
+		{
+			auto queriedChunks = getQueriedChunks();
+			for (int iChunk = firstChunkIndex; iChunk < (int)queriedChunks.size(); iChunk++)
+			{
+				if (queriedChunks[iChunk].chunk->size > 0)
+					return iChunk;
+			}
+			return -1;
+		}
+
+		// The arrays of the non-const components count as written when an iteration enters the chunk
+		void markWrittenArraysChanged(Chunk* chunk) const
+		{
+			(markChangedIfWritable<Ts>(chunk), ...);
+		}
+
+		template<class T>
+		void markChangedIfWritable(Chunk* chunk) const
+		{
+			if constexpr (!std::is_const_v<T>)
+				chunk->markChanged(chunk->layout->getArrayIndex(ecs_->getTypeId<T>()));
+		}
+
 		template<bool TOnlyCurrentChunk = false>
 		struct iterator
 		{
 			iterator() = default;
 			iterator(View* v) : view(v)
 			{
+				_ASSERT_EXPR(!view->hasFieldByFieldComponents(), L"Components stored field by field can't be iterated as whole structs, use getFieldSpan!");
+				view->initializeData();
+				enterChunk(view->findChunkWithEntities(0));
+			}
+
+			iterator(View* v, int firstChunkIndex) : view(v)
+			{
+				_ASSERT_EXPR(!view->hasFieldByFieldComponents(), L"Components stored field by field can't be iterated as whole structs, use getFieldSpan!");
+				view->initializeData();
+				enterChunk(view->getQueriedChunks()[firstChunkIndex].chunk->size > 0 ? firstChunkIndex : -1);
+			}
+
+			// Only the entities [firstEntityIndex, endEntityIndex) of the chunk.
+			// The ranges of a split chunk can be iterated concurrently, so only the one with the start of the chunk stamps its versions.
+			iterator(View* v, int chunkIndex, int firstEntityIndex, int endEntityIndex) : view(v)
+			{
+				_ASSERT_EXPR(!view->hasFieldByFieldComponents(), L"Components stored field by field can't be iterated as whole structs, use getFieldSpan!");
 				view->initializeData();
-				if (view->queriedChunks_.size() > 0)
+				if (firstEntityIndex < endEntityIndex)
 				{
-					chunkIndex = 0;
-					entityIndex = 0;
+					this->chunkIndex = chunkIndex;
+					entityIndex = firstEntityIndex;
+					this->endEntityIndex = endEntityIndex;
+					if (firstEntityIndex == 0)
+						view->markWrittenArraysChanged(view->getQueriedChunks()[chunkIndex].chunk);
+				}
+			}
 
-					//createCurrentTuple(std::index_sequence_for<Ts...>());
+			void enterChunk(int newChunkIndex)
+			{
+				chunkIndex = newChunkIndex;
+				entityIndex = chunkIndex >= 0 ? 0 : -1;
+				if (chunkIndex >= 0)
+				{
+					Chunk* chunk = view->getQueriedChunks()[chunkIndex].chunk;
+					endEntityIndex = chunk->size;
+					view->markWrittenArraysChanged(chunk);
 				}
 			}
 
@@ -121,7 +226,7 @@ namespace ecs
 
 			iterator& operator++()
 			{
-				if (view->queriedChunks_[chunkIndex].entityCount - 1 > entityIndex)
+				if (endEntityIndex - 1 > entityIndex)
 				{
 					entityIndex++;
 				}
@@ -133,15 +238,7 @@ namespace ecs
 					}
 					else
 					{
-						if ((int)view->queriedChunks_.size() - 1 > chunkIndex)
-						{
-							chunkIndex++;
-							entityIndex = 0;
-						}
-						else
-						{
-							chunkIndex = -1;
-						}
+						enterChunk(view->findChunkWithEntities(chunkIndex + 1));
 					}
 				}
 
@@ -173,13 +270,13 @@ namespace ecs
 			template<class ...Ts>
 			bool hasComponents() const
 			{
-				return view->queriedChunks_[chunkIndex].chunk->archetype->containedTypes_.hasAllTypes(view->ecs_->getTypeIds<Ts...>());
+				return view->getQueriedChunks()[chunkIndex].chunk->archetype->containedTypes_.hasAllTypes(view->ecs_->getTypeIds<Ts...>());
 			}
 
 			template<class TSharedComp>
 			const TSharedComp* getSharedComponent() const
 			{
-				return view->queriedChunks_[chunkIndex].chunk->getSharedComponent<TSharedComp>(view->ecs_->getTypeId<TSharedComp>());
+				return view->getQueriedChunks()[chunkIndex].chunk->getSharedComponent<TSharedComp>(view->ecs_->getTypeId<TSharedComp>());
 			}
 
 			std::tuple<const entityId&, Ts&...> operator*() const
@@ -196,26 +293,24 @@ namespace ecs
 			{
 				return
 				{
-					reinterpret_cast<const entityId*>(view->queriedChunks_[chunkIndex].buffers[0])[entityIndex],
-					reinterpret_cast<Ts*>(view->queriedChunks_[chunkIndex].buffers[Is + 1])[entityIndex]...
+					reinterpret_cast<const entityId*>(view->getQueriedChunks()[chunkIndex].buffers[0])[entityIndex],
+					reinterpret_cast<Ts*>(view->getQueriedChunks()[chunkIndex].buffers[Is + 1])[entityIndex]...
 				};
 			}
 
 			template<class T>
 			T* getComponent() const
 			{
-				Chunk* chunk = view->queriedChunks_[chunkIndex].chunk;
+				Chunk* chunk = view->getQueriedChunks()[chunkIndex].chunk;
 				auto tid = view->ecs_->getTypeId<T>();
-				auto componentArray = static_cast<ComponentArray<std::decay_t<T>>*>(chunk->getArray(tid));
-				if (!componentArray)
-					return nullptr;
-				return componentArray->getElement(entityIndex);
+				return chunk->getComponent<std::decay_t<T>>(tid, entityIndex);
 			}
 
 			View* view = nullptr;
 			//std::array<uint8_t, sizeof(std::tuple<const entityId&, Ts&...>)> currentTupleBuffer = {};
 			int chunkIndex = -1;
 			int entityIndex = -1;
+			int endEntityIndex = 0;
 		};
 
 		iterator<false> begin() {
@@ -228,9 +323,11 @@ namespace ecs
 		}
 
 		iterator<true> beginForChunk(int chunkIndex) {
-			auto it = iterator<true>(this);
-			it.chunkIndex = chunkIndex;
-			return it;
+			return iterator<true>(this, chunkIndex);
+		}
+
+		iterator<true> beginForChunk(int chunkIndex, int firstEntityIndex, int endEntityIndex) {
+			return iterator<true>(this, chunkIndex, firstEntityIndex, endEntityIndex);
 		}
 
 		iterator<true> endForChunk() {
@@ -288,13 +385,141 @@ namespace ecs
 			ecs_->addToCommandBuffer(std::make_unique<EntityCommand_SetSharedComponent<T>>(id, data));
 		}
 
+		// Calls fn(int entityCount, const entityId* entityIds, Ts*... components) once per chunk.
+		// Every array starts on a 64 byte boundary (ChunkLayout::columnAlignment), so the callback can be a plain loop over the arrays that the compiler vectorizes.
+		template<class Fn>
+		void forEachChunk(Fn&& fn)
+		{
+			_ASSERT_EXPR(!hasFieldByFieldComponents(), L"Components stored field by field have no struct arrays, use getFieldSpan!");
+			initializeData();
+			for (auto& queriedChunk : getQueriedChunks())
+			{
+				if (queriedChunk.chunk->size == 0)
+					continue;
+
+				markWrittenArraysChanged(queriedChunk.chunk);
+				callForChunk(fn, queriedChunk, std::index_sequence_for<Ts...>());
+			}
+		}
+
+		// Like forEachChunk, but the calls are spread over the threads of the task scheduler (see Ecs::setTaskScheduler) and can run concurrently.
+		// Large chunks are split into slices, so fn can get the same chunk in several calls with fewer than all of its entities.
+		// Runs inline when the view has few entities or there is no task scheduler.
+		template<class Fn>
+		void parallelForEachChunk(Fn&& fn)
+		{
+			_ASSERT_EXPR(!hasFieldByFieldComponents(), L"Components stored field by field have no struct arrays, use getFieldSpan!");
+			initializeData();
+			auto queriedChunks = getQueriedChunks();
+			int entityCount = 0;
+			for (auto& queriedChunk : queriedChunks)
+			{
+				if (queriedChunk.chunk->size == 0)
+					continue;
+
+				// stamped up front, the workers would race on the versions
+				markWrittenArraysChanged(queriedChunk.chunk);
+				entityCount += queriedChunk.chunk->size;
+			}
+
+			ftl::TaskScheduler* taskScheduler = ecs_->taskScheduler_;
+			if (!taskScheduler || entityCount < parallelForMinEntityCount)
+			{
+				for (auto& queriedChunk : queriedChunks)
+				{
+					if (queriedChunk.chunk->size > 0)
+						callForSlice(fn, queriedChunk, 0, queriedChunk.chunk->size, std::index_sequence_for<Ts...>());
+				}
+				return;
+			}
+
+			struct Slice
+			{
+				int chunkIndex;
+				int firstElementIndex;
+				int count;
+			};
+
+			int sliceCount = (int)taskScheduler->GetThreadCount() * parallelForSlicesPerThread;
+			int sliceSize = std::max(parallelForMinSliceSize, (entityCount + sliceCount - 1) / sliceCount);
+			std::vector<Slice> slices;
+			for (int iChunk = 0; iChunk < (int)queriedChunks.size(); iChunk++)
+			{
+				int chunkSize = queriedChunks[iChunk].chunk->size;
+				for (int first = 0; first < chunkSize; first += sliceSize)
+				{
+					slices.push_back({ iChunk, first, std::min(sliceSize, chunkSize - first) });
+				}
+			}
+
+			auto runSlice = [&](int sliceIndex)
+			{
+				const Slice& slice = slices[sliceIndex];
+				callForSlice(fn, queriedChunks[slice.chunkIndex], slice.firstElementIndex, slice.count, std::index_sequence_for<Ts...>());
+			};
+			parallelFor(taskScheduler, (int)slices.size(), runSlice);
+		}
+
+		// Calls fn(entityId id, Ts&... components) for every entity of the view, spread over the task scheduler threads like parallelForEachChunk
+		template<class Fn>
+		void parallelForEach(Fn&& fn)
+		{
+			parallelForEachChunk([&](int count, const entityId* ids, Ts*... components)
+				{
+					for (int i = 0; i < count; i++)
+					{
+						fn(ids[i], components[i]...);
+					}
+				});
+		}
+
+		int getChunkCount()
+		{
+			initializeData();
+			return (int)getQueriedChunks().size();
+		}
+
+		// A field of a component stored field by field (see Ecs::registerSoAType) in one chunk of the view, empty if the chunk doesn't have the component.
+		// Loops over a span only touch that field and can be vectorized.
+		template<class T, class F>
+		FieldSpan<F> getFieldSpan(int chunkIndex, F T::* field)
+		{
+			initializeData();
+			auto& queriedChunk = getQueriedChunks()[chunkIndex];
+			int arrayIndex = queriedChunk.chunk->layout->getArrayIndex(ecs_->getTypeId<T>());
+			if (arrayIndex < 0)
+				return {};
+
+			int fieldIndex = ecs_->getFieldIndex(field);
+			_ASSERT_EXPR(fieldIndex >= 0, L"The component isn't stored field by field or the member isn't in its registration!");
+			queriedChunk.chunk->markChanged(arrayIndex);	// the span is writable
+			return { reinterpret_cast<F*>(queriedChunk.chunk->getFieldArray(arrayIndex, fieldIndex)), queriedChunk.chunk->size };
+		}
+
+		template<class Fn, size_t... Is>
+		static void callForChunk(Fn& fn, const QueriedChunk<sizeof...(Ts)>& queriedChunk, std::index_sequence<Is...>)
+		{
+			fn(queriedChunk.chunk->size, reinterpret_cast<const entityId*>(queriedChunk.buffers[0]), reinterpret_cast<Ts*>(queriedChunk.buffers[Is + 1])...);
+		}
+
+		template<class Fn, size_t... Is>
+		static void callForSlice(Fn& fn, const QueriedChunk<sizeof...(Ts)>& queriedChunk, int firstElementIndex, int count, std::index_sequence<Is...>)
+		{
+			fn(count, reinterpret_cast<const entityId*>(queriedChunk.buffers[0]) + firstElementIndex, reinterpret_cast<Ts*>(queriedChunk.buffers[Is + 1]) + firstElementIndex...);
+		}
+
+		bool hasFieldByFieldComponents() const
+		{
+			return (false || ... || (ecs_->getTypeId<Ts>()->fields.size() > 0));
+		}
+
 		size_t getCount()
 		{
 			initializeData();
 			size_t count = 0;
-			for (auto& chunk : queriedChunks_)
+			for (auto& queriedChunk : getQueriedChunks())
 			{
-				count += chunk.entityCount;
+				count += queriedChunk.chunk->size;
 			}
 
 			return count;
@@ -302,7 +527,81 @@ namespace ecs
 
 		Ecs* ecs_;
 		typeQueryList typeQueryList;
-		std::vector<Ecs::QueriedChunk<sizeof...(Ts)>> queriedChunks_;
+		CachedQuery<sizeof...(Ts)>* cachedQuery_ = nullptr;
+		int cachedChunkCount_ = 0;
+		uint64_t removedChunkCount_ = 0;
+		std::vector<QueriedChunk<sizeof...(Ts)>> filteredChunks_;	// only used after filterShared
+		bool filtered_ = false;
 		bool initialized_ = false;
 	};
+
+	// Owns the view, so added() and removed() can be called on a temporary view in a range for
+	template<class ...Ts>
+	struct View<Ts...>::EventRange
+	{
+		struct iterator
+		{
+			iterator() = default;
+			iterator(const EventRange* r) : range(r)
+			{
+				findMatchingEntity();
+			}
+
+			// Skips the ids that got deleted, don't match the view or changed C back since the event
+			void findMatchingEntity()
+			{
+				Ecs* ecs = range->view.ecs_;
+				for (; eventIndex < (int)range->ids->size(); eventIndex++)
+				{
+					const entityDataIndex* location = ecs->entityLocations_.find((*range->ids)[eventIndex]);
+					if (!location || location->archetypeIndex < 0)
+						continue;
+
+					Archetype* archetype = ecs->archetypes_[location->archetypeIndex].get();
+					if (archetype->containedTypes_.hasType(range->tid) != range->expectComponent || !range->view.typeQueryList.check(archetype->containedTypes_))
+						continue;
+
+					chunk = archetype->chunks[location->chunkIndex].get();
+					elementIndex = location->elementIndex;
+					range->view.markWrittenArraysChanged(chunk);
+					return;
+				}
+				chunk = nullptr;
+			}
+
+			iterator& operator++()
+			{
+				eventIndex++;
+				findMatchingEntity();
+				return *this;
+			}
+
+			bool operator==(const iterator& rhs) const { return chunk == rhs.chunk && (!chunk || eventIndex == rhs.eventIndex); }
+			bool operator!=(const iterator& rhs) const { return !(*this == rhs); }
+
+			std::tuple<const entityId&, Ts&...> operator*() const
+			{
+				Ecs* ecs = range->view.ecs_;
+				return { chunk->getEntityIds()[elementIndex], *chunk->getComponent<std::decay_t<Ts>>(ecs->getTypeId<Ts>(), elementIndex)... };
+			}
+
+			const EventRange* range = nullptr;
+			Chunk* chunk = nullptr;
+			int eventIndex = 0;
+			int elementIndex = -1;
+		};
+
+		iterator begin() const
+		{
+			view.initializeData();
+			return iterator(this);
+		}
+
+		iterator end() const { return iterator(); }
+
+		mutable View view;	// begin() has to initialize it
+		const std::vector<entityId>* ids;
+		typeId tid;
+		bool expectComponent;
+	};
 }
\ No newline at end of file
@@ -39,6 +39,8 @@ using istream = MyStream;
 //#include "view.h"
 #include <stdio.h>
 #include <chrono>
+#include <random>
+#include <unordered_map>
 
 struct Timer
 {
@@ -59,85 +61,1673 @@ struct Timer
 	std::chrono::high_resolution_clock::time_point start;
 };
 
+// Correctness checks, unlike the timings they are meant to pass on every run
+int failedCheckCount = 0;
+
+void check(bool condition, const char* description)
+{
+	if (!condition)
+	{
+		printf("CHECK FAILED: %s\n", description);
+		failedCheckCount++;
+	}
+}
+
 struct A
 {
-	int a = 0;
-};
+	int a = 0;
+};
+
+struct B
+{
+	int b = 0;
+	float bf = 0.0f;
+};
+
+struct C
+{
+	double c = 0;
+	std::vector<int> cs;
+
+	void save(istream& stream) const
+	{
+		stream.write((const char*)&c, sizeof(c));
+		ecs::saveVector(stream, cs);
+	}
+
+	void load(istream& stream)
+	{
+		stream.read((char*)&c, sizeof(c));
+		ecs::loadVector(stream, cs);
+	}
+};
+
+struct Big
+{
+	float values[64] = {};
+};
+
+// Doesn't fit the biggest chunk size class
+struct Huge
+{
+	float values[1 << 16] = {};
+};
+
+struct Particle
+{
+	float x = 0, y = 0, z = 0;
+	float vx = 0, vy = 0, vz = 0;
+	int flags = 0;
+};
+
+// Same as Particle, registered to be stored field by field
+struct ParticleSoA
+{
+	float x = 0, y = 0, z = 0;
+	float vx = 0, vy = 0, vz = 0;
+	int flags = 0;
+};
+
+// Leaves out a member, so it can't be stored field by field
+struct PartialSoA
+{
+	float x = 0;
+	float y = 0;
+};
+
+// Fill the type sets up to ECS_MAX_TYPE_COUNT
+template<int N>
+struct TypeLimitTag
+{
+	int value = N;
+};
+
+struct TypeLimitOverflow
+{
+	int value = 0;
+};
+
+// Every world registers the same types in the same order: a type gets its index from the first world that registers it (see Ecs::getTypeId_impl)
+void registerTestTypes(ecs::Ecs& ecs)
+{
+	ecs.registerType<A>("AComp");
+	ecs.registerType<B>("BComp");
+	ecs.registerType<C>("CComp");
+	ecs.registerType<Big>("BigComp");
+	ecs.registerType<Huge>("HugeComp");
+	ecs.registerType<Particle>("Particle");
+	ecs.registerSoAType<ParticleSoA>("ParticleSoA", &ParticleSoA::x, &ParticleSoA::y, &ParticleSoA::z, &ParticleSoA::vx, &ParticleSoA::vy, &ParticleSoA::vz, &ParticleSoA::flags);
+}
+
+void printAs(ecs::Ecs& ecs)
+{
+	for (auto it : ecs.view<A>())
+	{
+		auto& [id, a] = it;
+		printf("A {%lld, %d}\n", (long long)id, a.a);
+	}
+
+	printf("\n");
+}
+
+void printABs(ecs::Ecs& ecs, int maxCount = -1)
+{
+	int i = 0;
+
+	for (auto& [id, a, b] : ecs.view<A, B>())
+	{
+		i++;
+		if (maxCount >= 0 && i > maxCount)
+			continue;
+
+		printf("AB {%lld, a: %d, b: %d, bf: %0.2f}\n", (long long)id, a.a, b.b, b.bf);
+	}
+
+	printf("\n");
+}
+
+void processAb(A& a, B& b)
+{
+	EASY_FUNCTION();
+	a.a += b.b;
+	b.bf = a.a + b.b * sqrtf(b.bf);
+	for (int i = 0; i < 15; i++)
+	{
+		a.a += b.b;
+	}
+}
+
+void increaseAbs(ecs::Ecs& ecs)
+{
+	EASY_FUNCTION();
+	for (auto& [id, a, b] : ecs.view<A, B>())
+	{
+		processAb(a, b);
+	}
+}
+
+struct IncreaseAbs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<A, B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto abView = ecs::Job(ecs->view<A, B>());
+		JOB_SET_FN(abView)
+		{
+			auto& [id, a, b] = *it;
+			processAb(a, b);
+		};
+		JOB_SCHEDULE(abView);
+	}
+};
+
+struct MoveParticles : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<Particle>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto particles = ecs::Job(ecs->view<Particle>());
+		JOB_SET_FN(particles)
+		{
+			auto& [id, p] = *it;
+			p.x += p.vx;
+			p.y += p.vy;
+			p.z += p.vz;
+		};
+		JOB_SCHEDULE(particles);
+	}
+};
+
+struct ScaleBigs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<Big>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto bigs = ecs::Job(ecs->view<Big>());
+		JOB_SET_FN(bigs)
+		{
+			auto& [id, big] = *it;
+			for (float& value : big.values)
+				value = value * 0.5f + 1.0f;
+		};
+		JOB_SCHEDULE(bigs);
+	}
+};
+
+// Reads what IncreaseAbs writes, so it has to run after it
+struct SumAbs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A, const B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto abs = ecs::Job(ecs->view<const A, const B>());
+		JOB_SET_FN(abs)
+		{
+			auto& [id, a, b] = *it;
+			sum += a.a + b.b;
+		};
+		JOB_SCHEDULE(abs);
+	}
+
+	std::atomic<int> sum = 0;
+};
+
+// Counts the B events of the frame, deleteAddedBs takes the added Bs away again through the command buffer
+struct CountBEvents : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A, const B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto commands = ecs->view<const A>();
+		addedCount = 0;
+		removedCount = 0;
+		for (auto [id, a, b] : ecs->view<const A, const B>().added<B>())
+		{
+			addedCount++;
+			if (deleteAddedBs)
+				commands.deleteComponents<B>(id);
+		}
+		for (auto [id, a] : ecs->view<const A>().removed<B>())
+			removedCount++;
+	}
+
+	int addedCount = 0;
+	int removedCount = 0;
+	bool deleteAddedBs = false;
+};
+
+// Only reads, so any number of them can run at the same time
+struct ReadOnlySystem : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+	}
+};
+
+struct SumAs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto as = ecs::Job(ecs->view<const A>());
+		JOB_SET_FN(as)
+		{
+			auto& [id, a] = *it;
+			sum += a.a;
+		};
+		JOB_SCHEDULE(as);
+	}
+
+	std::atomic<long long> sum = 0;
+};
+
+// Counts how often the tasks visit every entity in B::b
+struct CountVisits : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto bs = ecs::Job(ecs->view<B>());
+		JOB_SET_FN(bs)
+		{
+			auto& [id, b] = *it;
+			b.b++;
+		};
+		JOB_SCHEDULE(bs);
+	}
+};
+
+struct CountVisitsChunked : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto bs = ecs::ChunkJob(ecs->view<B>(), [](int entityCount, const ecs::entityId* ids, B* bs)
+			{
+				for (int i = 0; i < entityCount; i++)
+				{
+					bs[i].b++;
+				}
+			});
+		JOB_SCHEDULE(bs);
+	}
+};
+
+// The same work once with a per entity job and once with a chunk job
+struct BlendBs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A, B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto abs = ecs::Job(ecs->view<const A, B>());
+		JOB_SET_FN(abs)
+		{
+			auto& [id, a, b] = *it;
+			b.bf = b.bf * 0.5f + a.a;
+		};
+		JOB_SCHEDULE(abs);
+	}
+};
+
+struct BlendBsChunked : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<const A, B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		auto abs = ecs::ChunkJob(ecs->view<const A, B>(), [](int entityCount, const ecs::entityId* ids, const A* as, B* bs)
+			{
+				for (int i = 0; i < entityCount; i++)
+				{
+					bs[i].bf = bs[i].bf * 0.5f + as[i].a;
+				}
+			});
+		JOB_SCHEDULE(abs);
+	}
+};
+
+// Two independent jobs that can overlap and one that needs the result of the first
+struct OverlappingJobs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<A, B, Particle>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		std::atomic<bool> asReleased = !holdAsJob;	// declared before the jobs, so it outlives the A tasks
+		auto as = ecs::ChunkJob(ecs->view<A>(), [&asReleased](int entityCount, const ecs::entityId* ids, A* as)
+			{
+				while (!asReleased)
+				{
+				}
+				for (int i = 0; i < entityCount; i++)
+				{
+					as[i].a++;
+				}
+			});
+		ecs::JobHandle asDone = JOB_SCHEDULE(as);
+		if (waitEachJob)
+			waitForJobs(asDone);
+
+		auto particles = ecs::ChunkJob(ecs->view<Particle>(), [](int entityCount, const ecs::entityId* ids, Particle* particles)
+			{
+				for (int i = 0; i < entityCount; i++)
+				{
+					particles[i].x += particles[i].vx;
+					particles[i].y += particles[i].vy;
+					particles[i].z += particles[i].vz;
+				}
+			});
+		ecs::JobHandle particlesDone = JOB_SCHEDULE(particles);
+		if (waitEachJob)
+			waitForJobs(particlesDone);
+
+		auto bs = ecs::ChunkJob(ecs->view<const A, B>(), [](int entityCount, const ecs::entityId* ids, const A* as, B* bs)
+			{
+				for (int i = 0; i < entityCount; i++)
+				{
+					bs[i].b = as[i].a;
+				}
+			});
+		bsScheduledWhileAsRuns = !asDone.isDone();
+		JOB_SCHEDULE_AFTER(bs, asDone);
+		asReleased = true;
+	}
+
+	bool waitEachJob = false;
+	bool holdAsJob = false;	// keeps the A tasks from finishing until the B job is scheduled after them
+	bool bsScheduledWhileAsRuns = false;
+};
+
+// The handle of the first job outlives the job, the second job starts after it anyway
+struct ScopedJobs : ecs::System
+{
+	void declareQueries() override
+	{
+		declareQuery<A, B>();
+	}
+
+	void scheduleJobs(ecs::Ecs* ecs) override
+	{
+		ecs::JobHandle asDone;
+		{
+			auto as = ecs::ChunkJob(ecs->view<A>(), [](int entityCount, const ecs::entityId* ids, A* as)
+				{
+					for (int i = 0; i < entityCount; i++)
+					{
+						as[i].a++;
+					}
+				});
+			asDone = JOB_SCHEDULE(as);
+		}
+
+		auto bs = ecs::ChunkJob(ecs->view<const A, B>(), [](int entityCount, const ecs::entityId* ids, const A* as, B* bs)
+			{
+				for (int i = 0; i < entityCount; i++)
+				{
+					bs[i].b = as[i].a;
+				}
+			});
+		JOB_SCHEDULE_AFTER(bs, asDone);
+	}
+};
+
+void benchmarkEntityLocations(int entityCount)
+{
+	std::vector<ecs::entityId> lookupOrder(entityCount);
+	for (int i = 0; i < entityCount; i++)
+		lookupOrder[i] = i + 1;
+	std::shuffle(lookupOrder.begin(), lookupOrder.end(), std::mt19937(42));
+
+	printf("\nEntity location benchmark with %d entities\n", entityCount);
+	{
+		ecs::EntityLocationTable locations;
+		long long checksum = 0;
+		{
+			Timer timer("EntityLocationTable create");
+			for (int i = 0; i < entityCount; i++)
+				locations.set(locations.create(), { 0, i / 128, i % 128 });
+		}
+		{
+			Timer timer("EntityLocationTable lookup");
+			for (ecs::entityId id : lookupOrder)
+				checksum += locations.find(id)->elementIndex;
+		}
+		{
+			Timer timer("EntityLocationTable delete");
+			for (ecs::entityId id : lookupOrder)
+				locations.release(id);
+		}
+		printf("checksum: %lld\n", checksum);
+	}
+
+	{
+		std::unordered_map<ecs::entityId, ecs::entityDataIndex> locations;
+		long long checksum = 0;
+		{
+			Timer timer("unordered_map create");
+			for (int i = 0; i < entityCount; i++)
+				locations[i + 1] = { 0, i / 128, i % 128 };
+		}
+		{
+			Timer timer("unordered_map lookup");
+			for (ecs::entityId id : lookupOrder)
+				checksum += locations.find(id)->second.elementIndex;
+		}
+		{
+			Timer timer("unordered_map delete");
+			for (ecs::entityId id : lookupOrder)
+				locations.erase(id);
+		}
+		printf("checksum: %lld\n", checksum);
+	}
+}
+
+void benchmarkBulkCreation(int entityCount)
+{
+	printf("\nBulk creation benchmark with %d entities\n", entityCount);
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs::Prefab<A, B> abPrefab{ A{1}, B{1, 1.0f} };
+
+		Timer timer("createEntity one by one");
+		for (int i = 0; i < entityCount; i++)
+		{
+			ecs.createEntity(abPrefab);
+		}
+	}
+
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+
+		Timer timer("createEntities with initial values");
+		ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	}
+
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+
+		Timer timer("createEntities with generator");
+		ecs.createEntities<A, B>(entityCount, [](int i, A& a, B& b)
+		{
+			a.a = i;
+			b.b = 1;
+			b.bf = 1.0f;
+		});
+	}
+}
+
+void testEntityTableChurn(int entityCount, int rounds)
+{
+	printf("\nEntity table churn test with %d entities, %d rounds\n", entityCount, rounds);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+
+	std::vector<ecs::entityId> previousIds;
+	bool allAlive = true;
+	bool staleIdFound = false;
+	for (int round = 0; round < rounds; round++)
+	{
+		ecs::EntityRange entities = ecs.createEntities(entityCount, A{ round }, B{ round, 1.0f });
+		for (ecs::entityId id : entities)
+			allAlive = allAlive && ecs.getEntityLocations().find(id) != nullptr;
+		for (ecs::entityId id : previousIds)
+			staleIdFound = staleIdFound || ecs.getEntityLocations().find(id) != nullptr;
+
+		previousIds.clear();
+		for (ecs::entityId id : entities)
+		{
+			previousIds.push_back(id);
+			ecs.deleteEntity(id);
+		}
+	}
+
+	printf("slots: %d\n", ecs.getEntityLocations().getSlotCount());
+	check(allAlive, "every id of a created range is alive");
+	check(!staleIdFound, "the ids of deleted entities stay stale after their slots are reused");
+	check(ecs.getEntityLocations().size() == 0, "no entity is left after deleting all of them");
+	check(ecs.getEntityLocations().getSlotCount() <= entityCount + 1, "bulk creation reuses the released slots");
+	check(ecs.createEntities(0, A{ 0 }).size() == 0 && ecs.createEntities(-1, A{ 0 }).size() == 0, "creating zero or less entities gives an empty range");
+}
+
+void testChunkRecycling(int entityCount, int rounds)
+{
+	printf("\nChunk recycling test with %d entities, %d rounds\n", entityCount, rounds);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+
+	size_t firstRoundSlabCount = 0;
+	for (int round = 0; round < rounds; round++)
+	{
+		ecs::EntityRange entities = ecs.createEntities(entityCount, A{ round }, B{ round, 1.0f });
+		for (ecs::entityId id : entities)
+			ecs.deleteEntity(id);
+		if (round == 0)
+			firstRoundSlabCount = ecs.getChunkAllocator().getStats().slabCount;
+	}
+
+	const ecs::ChunkAllocator::Stats& stats = ecs.getChunkAllocator().getStats();
+	check(stats.blocksInUse == 0, "deleting every entity frees every chunk");
+	check(stats.slabCount == firstRoundSlabCount, "the later rounds reuse the freed chunks instead of adding slabs");
+	check(stats.allocationCount - stats.recycledAllocationCount == stats.peakBlocksInUse, "only the peak number of chunks is carved from the slabs");
+}
+
+void testSaveLoad(int entityCount)
+{
+	printf("\nSave and load test with %d entities\n", entityCount);
+	std::vector<char> buffer(1 << 20);
+	MyStream stream(buffer.data());
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs.createEntities<A, C>(entityCount, [](int i, A& a, C& c)
+			{
+				a.a = i;
+				c.c = i * 0.5;
+				c.cs = { i, i + 1, i + 2 };
+			});
+		ecs.save(stream);
+	}
+
+	stream.reset();
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.load(stream);
+
+	int loadedCount = 0;
+	bool valuesMatch = true;
+	for (auto& [id, a, c] : ecs.view<const A, const C>())
+	{
+		loadedCount++;
+		valuesMatch = valuesMatch && c.c == a.a * 0.5 && c.cs == std::vector<int>{ a.a, a.a + 1, a.a + 2 };
+	}
+	check(loadedCount == entityCount, "every saved entity is loaded");
+	check(valuesMatch, "components with save and load functions keep their values");
+}
+
+void testBatchedMoves(int entityCount)
+{
+	printf("\nBatched move test with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs::EntityRange entities = ecs.createEntities<A, C>(entityCount, [](int i, A& a, C& c)
+		{
+			a.a = i;
+			c.c = i * 0.5;
+		});
+
+	// every other entity gets B, then every fourth loses it again, the moves leave holes that get tail filled
+	std::unordered_map<ecs::entityId, int> indexById;
+	std::vector<ecs::entityId> withB;
+	std::vector<ecs::entityId> withoutBAgain;
+	for (int i = 0; i < entityCount; i++)
+	{
+		indexById[entities[i]] = i;
+		if (i % 2 == 0)
+			withB.push_back(entities[i]);
+		if (i % 4 == 0)
+			withoutBAgain.push_back(entities[i]);
+	}
+	ecs.addComponent(withB, B{ 2, 2.0f });
+	ecs.deleteComponents(withoutBAgain, ecs.getTypeIds<B>());
+
+	int visitedCount = 0;
+	bool componentsIntact = true;
+	for (auto& [id, a, c] : ecs.view<const A, const C>())
+	{
+		visitedCount++;
+		int i = indexById[id];
+		componentsIntact = componentsIntact && a.a == i && c.c == i * 0.5 && ecs.hasAllComponents<B>(id) == (i % 2 == 0 && i % 4 != 0);
+	}
+	check(visitedCount == entityCount && componentsIntact, "batched moves keep every entity with its own components");
+
+	bool locationsIntact = true;
+	for (int i = 0; i < entityCount; i++)
+	{
+		const A* a = ecs.getComponent<A>(entities[i]);
+		locationsIntact = locationsIntact && a && a->a == i;
+	}
+	check(locationsIntact, "batched moves update the location of every moved entity");
+}
+
+void testChunkSizes(int entityCount)
+{
+	printf("\nChunk size test with %d entities\n", entityCount);
+	const ecs::ChunkSizeClass sizeClasses[] = { ecs::ChunkSizeClass::Size16K, ecs::ChunkSizeClass::Size64K, ecs::ChunkSizeClass::Size256K, ecs::ChunkSizeClass::Auto };
+	for (ecs::ChunkSizeClass sizeClass : sizeClasses)
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs.setDefaultChunkSize(sizeClass);
+		ecs.createEntities(entityCount, Big{});
+		auto huge = std::make_unique<Huge>();
+		ecs.createEntities(3, *huge);
+
+		check(ecs.view<Big>().getCount() == (size_t)entityCount, "every size class has room for Big");
+		check(ecs.view<Huge>().getCount() == 3 && ecs.view<Huge>().getChunkCount() <= 3, "a component bigger than the biggest size class still gets a chunk");
+		if (sizeClass == ecs::ChunkSizeClass::Auto)
+		{
+			int maxChunkCount = (entityCount + ecs::ChunkLayout::autoChunkEntityCount - 1) / ecs::ChunkLayout::autoChunkEntityCount;
+			check(ecs.view<Big>().getChunkCount() <= maxChunkCount, "Auto fits autoChunkEntityCount Bigs in a chunk");
+		}
+	}
+}
+
+void testFieldByField(int entityCount)
+{
+	printf("\nField by field test with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.registerSoAType<PartialSoA>("PartialSoA", &PartialSoA::x);
+	check(!ecs.getTypeIdByName("PartialSoA"), "a component with an unlisted member is not registered");
+
+	ecs.createEntities(entityCount, ParticleSoA{ 1, 2, 3, 4, 5, 6, 7 });
+	auto view = ecs.view<>().with<ParticleSoA>();
+	int visitedCount = 0;
+	bool fieldsMatch = true;
+	for (int iChunk = 0; iChunk < view.getChunkCount(); iChunk++)
+	{
+		ecs::FieldSpan<float> y = view.getFieldSpan(iChunk, &ParticleSoA::y);
+		ecs::FieldSpan<float> vz = view.getFieldSpan(iChunk, &ParticleSoA::vz);
+		ecs::FieldSpan<int> flags = view.getFieldSpan(iChunk, &ParticleSoA::flags);
+		for (int i = 0; i < y.size; i++)
+			fieldsMatch = fieldsMatch && y[i] == 2 && vz[i] == 6 && flags[i] == 7;
+		visitedCount += y.size;
+	}
+	check(visitedCount == entityCount && fieldsMatch, "every field array holds its own field");
+}
+
+void testChunkAlignment(int entityCount)
+{
+	printf("\nChunk alignment test with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	ecs.createEntities(entityCount, A{ 1 }, Big{});
+	ecs.createEntities(entityCount, B{ 1, 1.0f }, Particle{});
+
+	auto isAligned = [](const void* array) { return (uintptr_t)array % ecs::ChunkLayout::columnAlignment == 0; };
+	bool allAligned = true;
+	int visitedCount = 0;
+	ecs.view<const A>().forEachChunk([&](int count, const ecs::entityId* ids, const A* as)
+		{
+			allAligned = allAligned && isAligned(as);
+			visitedCount += count;
+		});
+	ecs.view<const B, const Particle>().forEachChunk([&](int count, const ecs::entityId* ids, const B* bs, const Particle* particles)
+		{
+			allAligned = allAligned && isAligned(bs) && isAligned(particles);
+			visitedCount += count;
+		});
+	ecs.view<const A, const Big>().forEachChunk([&](int count, const ecs::entityId* ids, const A* as, const Big* bigs)
+		{
+			allAligned = allAligned && isAligned(as) && isAligned(bigs);
+			visitedCount += count;
+		});
+	check(visitedCount == entityCount * 4, "forEachChunk visits every entity of the views");
+	check(allAligned, "the arrays of forEachChunk start on a cache line");
+}
+
+void testCreateWhileIterating(int entityCount)
+{
+	printf("\nCreate while iterating test with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 });
+
+	// every new entity needs a new chunk sooner or later, the chunk list of the query grows during the loop
+	int visitedCount = 0;
+	for (auto& [id, a] : ecs.view<A>())
+	{
+		visitedCount++;
+		ecs.createEntity(A{ 2 });
+	}
+	// the last chunk can get some of the new entities before the loop reaches it, the new chunks are not visited
+	check(visitedCount >= entityCount && visitedCount < entityCount * 2, "a view only visits the chunks that existed when the iteration started");
+	check(ecs.view<A>().getCount() == (size_t)(entityCount + visitedCount), "the entities created during the iteration are there");
+
+	// deleting everything removes the chunks from the cached query, in any order
+	std::vector<ecs::entityId> ids;
+	for (auto& [id, a] : ecs.view<const A>())
+		ids.push_back(id);
+	for (ecs::entityId id : ids)
+		ecs.deleteEntity(id);
+	check(ecs.view<A>().getCount() == 0, "no chunk with entities is left after deleting all of them");
+}
+
+template<int... Ns>
+void registerTypeLimitTags(ecs::Ecs& ecs, std::integer_sequence<int, Ns...>)
+{
+	(ecs.registerType<TypeLimitTag<Ns>>("TypeLimitTag"), ...);
+}
+
+void testTypeLimit()
+{
+	printf("\nType limit test with %d types\n", ECS_MAX_TYPE_COUNT);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	registerTypeLimitTags(ecs, std::make_integer_sequence<int, ECS_MAX_TYPE_COUNT>());	// the last few are already past the limit
+	ecs.registerType<TypeLimitOverflow>("TypeLimitOverflow");
+	check(!ecs.getTypeIdByName("TypeLimitOverflow"), "a type past ECS_MAX_TYPE_COUNT is not registered");
+
+	ecs.createEntities(100, A{ 1 }, B{ 1, 1.0f });
+	check(ecs.view<const A, const B>().getCount() == 100, "the registered types still work at the limit");
+}
+
+void testChangeFilter(int entityCount, int writeCount)
+{
+	printf("\nChange filter test with %d entities, %d writes\n", entityCount, writeCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+
+	uint64_t version = ecs.advanceChangeVersion();
+	check(ecs.view<const A, const B>().changedSince<A>(version).getCount() == 0, "no chunk is returned when nothing was written");
+
+	// all entities share one archetype, so the chunk index tells the chunks apart
+	std::mt19937 random(42);
+	std::vector<int> writtenChunks;
+	for (int i = 0; i < writeCount; i++)
+	{
+		ecs::entityId id = ids[random() % entityCount];
+		ecs.setComponent(id, A{ 2 });
+		writtenChunks.push_back(ecs.getEntityLocations().find(id)->chunkIndex);
+	}
+	std::sort(writtenChunks.begin(), writtenChunks.end());
+	writtenChunks.erase(std::unique(writtenChunks.begin(), writtenChunks.end()), writtenChunks.end());
+
+	std::vector<int> visitedChunks;
+	for (auto& [id, a, b] : ecs.view<const A, const B>().changedSince<A>(version))
+		visitedChunks.push_back(ecs.getEntityLocations().find(id)->chunkIndex);
+	visitedChunks.erase(std::unique(visitedChunks.begin(), visitedChunks.end()), visitedChunks.end());
+	std::sort(visitedChunks.begin(), visitedChunks.end());
+	check(visitedChunks == writtenChunks, "changedSince returns exactly the chunks that were written");
+	check(ecs.view<const A, const B>().changedSince<B>(version).getCount() == 0, "writing A does not mark B as changed");
+
+	// the iterator stamps the non-const arrays of the chunks it enters, reading through const doesn't
+	version = ecs.advanceChangeVersion();
+	int readCount = 0;
+	for (auto& [id, a, b] : ecs.view<const A, const B>())
+		readCount += a.a > 0 ? 1 : 0;
+	check(readCount == entityCount && ecs.view<const A, const B>().changedSince<A>(version).getCount() == 0, "iterating with const access doesn't mark the chunks changed");
+	for (auto& [id, a, b] : ecs.view<A, const B>())
+		a.a++;
+	check(ecs.view<const A, const B>().changedSince<A>(version).getCount() == (size_t)entityCount, "iterating with non-const access marks every chunk changed");
+	check(ecs.view<const A, const B>().changedSince<B>(version).getCount() == 0, "the const components of the iteration stay unchanged");
+}
+
+void testComponentEvents(int entityCount, int changeCount)
+{
+	printf("\nComponent events test with %d entities, %d changes\n", entityCount, changeCount);
+	for (bool singleThreaded : { false, true })
+	{
+		ecs::Ecs ecs;
+		auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+		registerTestTypes(ecs);
+		ecs.trackComponentEvents<B>();
+		CountBEvents* system = scheduler->addSystem<CountBEvents>();
+		scheduler->singleThreadedMode = singleThreaded;
+
+		ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 });
+		ecs.clearComponentEvents();
+
+		// the direct changes survive a command buffer executed before the frame
+		for (int i = 0; i < changeCount; i++)
+			ecs.addComponent(ids[i], B{ i, 1.0f });
+		ecs.executeCommmandBuffer();
+
+		system->deleteAddedBs = true;
+		scheduler->runSystems();
+		check(system->addedCount == changeCount && system->removedCount == 0, "the systems see the components added before the frame");
+
+		system->deleteAddedBs = false;
+		scheduler->runSystems();
+		check(system->addedCount == 0 && system->removedCount == changeCount, "the systems see the components removed by the command buffer of the previous frame");
+
+		scheduler->runSystems();
+		check(system->addedCount == 0 && system->removedCount == 0, "the events are cleared once the systems have seen them");
+
+		ecs.addComponent(ids[0], B{ 0, 1.0f });
+		auto addedBs = ecs.view<const B>().added<B>();
+		ecs.trackComponentEvents<C>();	// a type with a higher index must not move the events the range points to
+		int addedCount = 0;
+		for (auto [id, b] : addedBs)
+			addedCount++;
+		check(addedCount == 1, "an event range stays valid when another component gets tracked");
+	}
+}
+
+void testParallelForEach(int entityCount)
+{
+	printf("\nParallel forEach test with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities<A, B>(entityCount, [](int i, A& a, B& b)
+		{
+			a.a = i;
+			b.b = 0;
+		});
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+
+	long long serialSum = 0;
+	for (auto& [id, a] : ecs.view<const A>())
+		serialSum += a.a;
+
+	std::atomic<long long> parallelSum = 0;
+	ecs.view<const A>().parallelForEach([&](ecs::entityId id, const A& a)
+		{
+			parallelSum += a.a;
+		});
+	check(parallelSum == serialSum && serialSum == (long long)entityCount * (entityCount - 1) / 2, "the parallelForEach sum equals the serial sum");
+
+	ecs.view<B>().parallelForEachChunk([](int count, const ecs::entityId* ids, B* bs)
+		{
+			for (int i = 0; i < count; i++)
+				bs[i].b++;
+		});
+	bool visitedOnce = true;
+	for (auto& [id, b] : ecs.view<const B>())
+		visitedOnce = visitedOnce && b.b == 1;
+	check(visitedOnce, "parallelForEachChunk visits every entity exactly once");
+}
+
+void testSystemOrder(int entityCount, int frames)
+{
+	printf("\nSystem order test with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	ecs.createEntities(entityCount, Particle{ 0, 0, 0, 1, 1, 1 });
+	ecs.createEntities(entityCount / 100, Big{});
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+
+	scheduler->addSystem<IncreaseAbs>();
+	scheduler->addSystem<MoveParticles>();
+	scheduler->addSystem<ScaleBigs>();
+	SumAbs* sumAbs = scheduler->addSystem<SumAbs>();
+	scheduler->compilePipeline();
+	check(scheduler->systemStages == std::vector<int>({ 0, 0, 0, 1 }), "the independent writers share the first stage and the reader gets the next one");
+
+	for (int frame = 1; frame <= frames; frame++)
+	{
+		sumAbs->sum = 0;
+		scheduler->runSystems();
+		int a = 1 + 16 * frame;	// processAb adds b 16 times
+		check(sumAbs->sum == entityCount * (a + 1), "the reader sees what its writer wrote in the same frame");
+	}
+}
+
+void testTaskSplitting(int entityCount, int frames)
+{
+	printf("\nTask splitting test with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 }, B{ 0, 1.0f });
+	int aliveCount = 0;
+	for (int i = 0; i < entityCount; i++)
+	{
+		if (i % 3 == 0)
+			ecs.deleteEntity(ids[i]);	// leaves every chunk partially filled
+		else
+			aliveCount++;
+	}
+
+	for (bool chunked : { false, true })
+	{
+		auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+		if (chunked)
+			scheduler->addSystem<CountVisitsChunked>();
+		else
+			scheduler->addSystem<CountVisits>();
+		scheduler->targetTaskEntityCount = 100;	// below the chunk capacity, so the tasks split chunks as well as span them
+		for (bool autoTune : { false, true })
+		{
+			scheduler->autoTuneTaskSize = autoTune;
+			for (auto& [id, b] : ecs.view<B>())
+				b.b = 0;
+
+			for (int frame = 0; frame < frames; frame++)
+				scheduler->runSystems();
+
+			int visitedCount = 0;
+			bool visitedOnce = true;
+			for (auto& [id, b] : ecs.view<const B>())
+			{
+				visitedOnce = visitedOnce && b.b == frames;
+				visitedCount++;
+			}
+			char description[128];
+			sprintf_s(description, "the %s tasks of the %s visit every entity once per frame", autoTune ? "auto tuned" : "fixed size", chunked ? "chunk job" : "entity job");
+			check(visitedCount == aliveCount && visitedOnce, description);
+		}
+	}
+}
+
+void testChunkJobs(int entityCount, int frames)
+{
+	printf("\nChunk job test with %d entities, %d frames\n", entityCount, frames);
+	for (bool singleThreaded : { false, true })
+	{
+		// the same world twice, once blended by a per entity job and once by a chunk job
+		ecs::Ecs entityJobEcs;
+		ecs::Ecs chunkJobEcs;
+		auto entityJobScheduler = std::make_unique<ecs::Scheduler>(&entityJobEcs);
+		auto chunkJobScheduler = std::make_unique<ecs::Scheduler>(&chunkJobEcs);
+		for (ecs::Ecs* ecs : { &entityJobEcs, &chunkJobEcs })
+		{
+			registerTestTypes(*ecs);
+			ecs->createEntities<A, B>(entityCount, [](int i, A& a, B& b)
+				{
+					a.a = i % 7;
+					b.bf = (float)i;
+				});
+		}
+		entityJobScheduler->addSystem<BlendBs>();
+		chunkJobScheduler->addSystem<BlendBsChunked>();
+		entityJobScheduler->singleThreadedMode = singleThreaded;
+		chunkJobScheduler->singleThreadedMode = singleThreaded;
+		for (int frame = 0; frame < frames; frame++)
+		{
+			entityJobScheduler->runSystems();
+			chunkJobScheduler->runSystems();
+		}
+
+		int comparedCount = 0;
+		bool valuesMatch = true;
+		for (auto& [id, b] : entityJobEcs.view<const B>())
+		{
+			const B* chunkJobB = chunkJobEcs.getComponent<B>(id);
+			valuesMatch = valuesMatch && chunkJobB && chunkJobB->bf == b.bf;
+			comparedCount++;
+		}
+		check(comparedCount == entityCount && valuesMatch, "BlendBsChunked gives the same B values as BlendBs");
+	}
+}
+
+void testJobHandles(int entityCount, int frames)
+{
+	printf("\nJob handle test with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 0 }, B{ 0, 1.0f });
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	scheduler->addSystem<ScopedJobs>();
+	for (int frame = 0; frame < frames; frame++)
+		scheduler->runSystems();
 
-struct B
+	bool allUpdated = true;
+	for (auto& [id, a, b] : ecs.view<const A, const B>())
+		allUpdated = allUpdated && a.a == frames && b.b == frames;
+	check(allUpdated, "a job scheduled after a destroyed job sees its results");
+}
+
+void testJobOverlap(int entityCount, int frames)
 {
-	int b = 0;
-	float bf = 0.0f;
-};
+	printf("\nJob overlap test with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 0 }, B{ 0, 0.0f });
+	ecs.createEntities(entityCount, Particle{ 0, 0, 0, 1, 2, 3, 0 });
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	OverlappingJobs* system = scheduler->addSystem<OverlappingJobs>();
+	system->holdAsJob = true;
+	bool alwaysRunning = true;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		scheduler->runSystems();
+		alwaysRunning = alwaysRunning && system->bsScheduledWhileAsRuns;
+	}
+	check(alwaysRunning, "the B job is scheduled while the A job runs");
 
-struct C
+	// the B job ran after the A job of the same frame
+	int mismatchCount = 0;
+	for (auto& [id, a, b] : ecs.view<const A, const B>())
+		mismatchCount += a.a != b.b;
+	check(mismatchCount == 0, "a job scheduled after a running job sees its results");
+}
+
+// Creates and deletes whole chunks worth of entities, the chunk blocks should be recycled by the pool instead of going back to malloc
+void benchmarkChunkChurn(int entityCount, int rounds, bool useHugePages)
 {
-	double c = 0;
-	std::vector<int> cs;
-};
+	printf("\nChunk churn benchmark with %d entities, %d rounds, huge pages %s\n", entityCount, rounds, useHugePages ? "on" : "off");
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.getChunkAllocator().setUseHugePages(useHugePages);
 
-void printAs(ecs::Ecs& ecs)
+	{
+		Timer timer("create and delete");
+		for (int round = 0; round < rounds; round++)
+		{
+			ecs::EntityRange entities = ecs.createEntities(entityCount, A{ round }, B{ round, 1.0f });
+			for (ecs::entityId id : entities)
+			{
+				ecs.deleteEntity(id);
+			}
+		}
+	}
+
+	const ecs::ChunkAllocator::Stats& stats = ecs.getChunkAllocator().getStats();
+	printf("slabs: %zu (%zu huge), reserved: %zu KB, peak chunks: %zu, allocations: %zu, recycled: %zu\n",
+		stats.slabCount, stats.hugePageSlabCount, stats.reservedBytes / 1024, stats.peakBlocksInUse, stats.allocationCount, stats.recycledAllocationCount);
+}
+
+// Adds and removes a component one entity at a time vs with the batched calls that move whole chunks at once
+void benchmarkBatchedMoves(int entityCount)
 {
-	for (auto it : ecs.view<A>())
+	printf("\nBatched move benchmark with %d entities\n", entityCount);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+
+	ecs::EntityRange entities = ecs.createEntities(entityCount, A{ 1 }, C{ 1.0 });
+	std::vector<ecs::entityId> ids;
+	for (ecs::entityId id : entities)
+		ids.push_back(id);
+
 	{
-		auto& [id, a] = it;
-		printf("A {%u, %d}\n", id, a.a);
+		Timer timer("add and remove one by one");
+		for (ecs::entityId id : ids)
+			ecs.addComponent(id, B{ 2, 2.0f });
+		for (ecs::entityId id : ids)
+			ecs.deleteComponents(id, ecs.getTypeIds<B>());
 	}
 
-	printf("\n");
+	{
+		Timer timer("add and remove batched");
+		ecs.addComponent(ids, B{ 2, 2.0f });
+		ecs.deleteComponents(ids, ecs.getTypeIds<B>());
+	}
+
+	printf("entities back in the original archetype: %d\n", (int)ecs.view<A, C>().exclude<B>().getCount());
 }
 
-void printABs(ecs::Ecs& ecs, int maxCount = -1)
+// Iterates a small and a big component with every chunk size class
+void benchmarkChunkSizes(int entityCount, int passes)
 {
-	int i = 0;
+	printf("\nChunk size benchmark with %d entities, %d passes\n", entityCount, passes);
+	const std::pair<ecs::ChunkSizeClass, const char*> sizeClasses[] = {
+		{ ecs::ChunkSizeClass::Size16K, "16K" },
+		{ ecs::ChunkSizeClass::Size64K, "64K" },
+		{ ecs::ChunkSizeClass::Size256K, "256K" },
+		{ ecs::ChunkSizeClass::Auto, "auto" },
+	};
 
-	for (auto& [id, a, b] : ecs.view<A, B>())
+	for (auto& [sizeClass, sizeName] : sizeClasses)
 	{
-		i++;
-		if (maxCount >= 0 && i > maxCount)
-			continue;
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs.setDefaultChunkSize(sizeClass);
+		ecs.createEntities(entityCount, A{ 1 });
+		ecs.createEntities(entityCount / 8, Big{});
+
+		long long sum = 0;
+		{
+			Timer timer(std::string("iterate small ") + sizeName);
+			for (int pass = 0; pass < passes; pass++)
+			{
+				for (auto it : ecs.view<A>().exclude<Big>())
+				{
+					auto& [id, a] = it;
+					sum += a.a;
+				}
+			}
+		}
 
-		printf("AB {%u, a: %d, b: %d, bf: %0.2f}\n", id, a.a, b.b, b.bf);
+		float bigSum = 0;
+		{
+			Timer timer(std::string("iterate big ") + sizeName);
+			for (int pass = 0; pass < passes; pass++)
+			{
+				for (auto it : ecs.view<Big>())
+				{
+					auto& [id, big] = it;
+					bigSum += big.values[0];
+				}
+			}
+		}
+
+		printf("%s: chunks: %zu, sums: %lld %f\n", sizeName, ecs.getChunkAllocator().getStats().blocksInUse, sum, bigSum);
 	}
+}
 
-	printf("\n");
+// Integrates one axis of the particles stored as whole structs and stored field by field
+void benchmarkSoA(int entityCount, int passes)
+{
+	printf("\nSoA benchmark with %d entities, %d passes\n", entityCount, passes);
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs.createEntities(entityCount, Particle{ 0, 0, 0, 1, 2, 3, 0 });
+
+		{
+			Timer timer("integrate x, whole structs");
+			for (int pass = 0; pass < passes; pass++)
+			{
+				for (auto it : ecs.view<Particle>())
+				{
+					auto& [id, particle] = it;
+					particle.x += particle.vx;
+				}
+			}
+		}
+
+		float sum = 0;
+		for (auto it : ecs.view<Particle>())
+		{
+			auto& [id, particle] = it;
+			sum += particle.x;
+		}
+		printf("whole structs sum: %f\n", sum);
+	}
+
+	{
+		ecs::Ecs ecs;
+		registerTestTypes(ecs);
+		ecs.createEntities(entityCount, ParticleSoA{ 0, 0, 0, 1, 2, 3, 0 });
+
+		{
+			Timer timer("integrate x, field by field");
+			for (int pass = 0; pass < passes; pass++)
+			{
+				auto view = ecs.view<>().with<ParticleSoA>();
+				for (int iChunk = 0; iChunk < view.getChunkCount(); iChunk++)
+				{
+					ecs::FieldSpan<float> x = view.getFieldSpan(iChunk, &ParticleSoA::x);
+					ecs::FieldSpan<float> vx = view.getFieldSpan(iChunk, &ParticleSoA::vx);
+					for (int i = 0; i < x.size; i++)
+						x[i] += vx[i];
+				}
+			}
+		}
+
+		float sum = 0;
+		auto view = ecs.view<>().with<ParticleSoA>();
+		for (int iChunk = 0; iChunk < view.getChunkCount(); iChunk++)
+		{
+			for (float x : view.getFieldSpan(iChunk, &ParticleSoA::x))
+				sum += x;
+		}
+		printf("field by field sum: %f\n", sum);
+	}
 }
 
-void processAb(A& a, B& b)
+// processAb through the per entity iterator and through forEachChunk's column arrays
+void benchmarkChunkIteration(int entityCount, int passes)
 {
-	EASY_FUNCTION();
-	a.a += b.b;
-	b.bf = a.a + b.b * sqrtf(b.bf);
-	for (int i = 0; i < 15; i++)
+	printf("\nChunk iteration benchmark with %d entities, %d passes\n", entityCount, passes);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+
 	{
-		a.a += b.b;
+		Timer timer("processAb with the iterator");
+		for (int pass = 0; pass < passes; pass++)
+		{
+			for (auto& [id, a, b] : ecs.view<A, B>())
+			{
+				processAb(a, b);
+			}
+		}
+	}
+
+	{
+		Timer timer("processAb with forEachChunk");
+		for (int pass = 0; pass < passes; pass++)
+		{
+			ecs.view<A, B>().forEachChunk([](int entityCount, const ecs::entityId* ids, A* as, B* bs)
+				{
+					for (int i = 0; i < entityCount; i++)
+					{
+						processAb(as[i], bs[i]);
+					}
+				});
+		}
 	}
+
+	long long sum = 0;
+	ecs.view<A>().forEachChunk([&](int entityCount, const ecs::entityId* ids, A* as)
+		{
+			for (int i = 0; i < entityCount; i++)
+				sum += as[i].a;
+		});
+	printf("sum: %lld\n", sum);
 }
 
-void increaseAbs(ecs::Ecs& ecs)
+// Acquires the same view every frame, while chunks come and go between the frames
+void benchmarkViewAcquire(int entityCount, int frames)
 {
-	EASY_FUNCTION();
-	for (auto& [id, a, b] : ecs.view<A, B>())
+	printf("\nView acquire benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 });
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	ecs.createEntities(entityCount / 16, A{ 1 }, Big{});
+
+	size_t count = 0;
 	{
-		processAb(a, b);
+		Timer timer("acquire view<A>");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			count += ecs.view<A>().getCount();
+		}
 	}
+
+	// new archetypes and chunks after the query was cached have to show up, deleted chunks have to disappear
+	ecs::EntityRange extraEntities = ecs.createEntities(entityCount / 4, A{ 2 }, B{ 2, 2.0f }, Big{});
+	size_t countWithExtra = ecs.view<A>().getCount();
+	for (ecs::entityId id : extraEntities)
+		ecs.deleteEntity(id);
+	size_t countAfterDelete = ecs.view<A>().getCount();
+
+	printf("count: %zu, with extra: %zu, after delete: %zu\n", count / frames, countWithExtra, countAfterDelete);
 }
 
-struct IncreaseAbs : ecs::System
+// Matches queries of a few types against archetypes built from hundreds of registered types
+void benchmarkArchetypeMatching(int typeCount, int archetypeCount, int queryCount)
 {
-	void scheduleJobs(ecs::Ecs* ecs) override
+	printf("\nArchetype matching benchmark with %d types, %d archetypes, %d queries\n", typeCount, archetypeCount, queryCount);
+	std::vector<ecs::TypeDescriptor> typeDescriptors(typeCount);
+	for (int i = 0; i < typeCount; i++)
+		typeDescriptors[i].index = i;
+
+	std::mt19937 random(42);
+	std::uniform_int_distribution<int> randomType(0, typeCount - 1);
+	auto createRandomList = [&](int count)
 	{
-		auto abView = ecs::Job(ecs->view<A, B>());
-		JOB_SET_FN(abView)
+		ecs::typeIdList ret(typeCount, {});
+		for (int i = 0; i < count; i++)
+			ret.addTypes({ &typeDescriptors[randomType(random)] });
+		return ret;
+	};
+
+	std::vector<ecs::typeIdList> archetypes;
+	for (int i = 0; i < archetypeCount; i++)
+		archetypes.push_back(createRandomList(8));
+
+	std::vector<ecs::typeQueryList> queries;
+	for (int i = 0; i < queryCount; i++)
+	{
+		ecs::typeQueryList& query = queries.emplace_back(typeCount);
+		query.add(createRandomList(1), ecs::TypeQueryItem::Mode::Read);
+		query.add(createRandomList(1), ecs::TypeQueryItem::Mode::Exclude);
+	}
+
+	int matchCount = 0;
+	{
+		Timer timer("typeQueryList::check");
+		for (auto& query : queries)
 		{
-			auto& [id, a, b] = *it;
-			processAb(a, b);
-		};
-		JOB_SCHEDULE(abView);
+			for (auto& archetype : archetypes)
+				matchCount += query.check(archetype) ? 1 : 0;
+		}
 	}
-};
 
-void main()
+	size_t typeCountSum = 0;
+	{
+		Timer timer("typeIdList::calcTypeCount");
+		for (auto& archetype : archetypes)
+			typeCountSum += archetype.calcTypeCount();
+	}
+
+	printf("matches: %d, types: %zu\n", matchCount, typeCountSum);
+}
+
+// Processes the entities whose A was written since the last pass, a few of them are set between the passes
+void benchmarkChangeFilter(int entityCount, int passes)
+{
+	printf("\nChange filter benchmark with %d entities, %d passes\n", entityCount, passes);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+
+	std::mt19937 random(42);
+	uint64_t lastVersion = ecs.advanceChangeVersion();
+	size_t allCount = 0;
+	size_t changedCount = 0;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (int i = 0; i < 10; i++)
+			ecs.setComponent(ids[random() % entityCount], A{ pass });
+
+		{
+			Timer timer("all chunks");
+			for (auto& [id, a, b] : ecs.view<const A, const B>())
+				allCount += a.a > 0 ? 1 : 0;
+		}
+
+		{
+			Timer timer("changed chunks");
+			for (auto& [id, a, b] : ecs.view<const A, const B>().changedSince<A>(lastVersion))
+				changedCount += a.a > 0 ? 1 : 0;
+		}
+		lastVersion = ecs.advanceChangeVersion();
+	}
+
+	printf("visited all: %zu, changed: %zu\n", allCount, changedCount);
+}
+
+void benchmarkComponentEvents(int entityCount, int passes)
+{
+	printf("\nComponent events benchmark with %d entities, %d passes\n", entityCount, passes);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.trackComponentEvents<B>();
+	ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 });
+	ecs.clearComponentEvents();
+
+	std::mt19937 random(42);
+	size_t scannedCount = 0;
+	size_t addedCount = 0;
+	size_t removedCount = 0;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (int i = 0; i < 10; i++)
+		{
+			ecs::entityId id = ids[random() % entityCount];
+			if (ecs.hasAllComponents<B>(id))
+				ecs.deleteComponents(id, ecs.getTypeIds<B>());
+			else
+				ecs.addComponent(id, B{ pass, 1.0f });
+		}
+
+		{
+			Timer timer("scan all with B");
+			for (auto& [id, a, b] : ecs.view<const A, const B>())
+				scannedCount += b.b == pass ? 1 : 0;
+		}
+
+		{
+			Timer timer("added B");
+			for (auto [id, a, b] : ecs.view<const A, const B>().added<B>())
+				addedCount += b.b == pass ? 1 : 0;
+			for (auto [id, a] : ecs.view<const A>().removed<B>())
+				removedCount++;
+		}
+		ecs.clearComponentEvents();
+	}
+
+	printf("scanned: %zu, added: %zu, removed: %zu\n", scannedCount, addedCount, removedCount);
+}
+
+void benchmarkParallelForEach(int entityCount, int passes)
+{
+	printf("\nParallel forEach benchmark with %d entities, %d passes\n", entityCount, passes);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+
+	for (int pass = 0; pass < passes; pass++)
+	{
+		{
+			Timer timer("serial forEachChunk");
+			ecs.view<const A, B>().forEachChunk([](int count, const ecs::entityId* ids, const A* as, B* bs)
+				{
+					for (int i = 0; i < count; i++)
+						bs[i].bf += sqrtf((float)as[i].a + bs[i].bf);
+				});
+		}
+
+		{
+			Timer timer("parallelForEachChunk");
+			ecs.view<const A, B>().parallelForEachChunk([](int count, const ecs::entityId* ids, const A* as, B* bs)
+				{
+					for (int i = 0; i < count; i++)
+						bs[i].bf += sqrtf((float)as[i].a + bs[i].bf);
+				});
+		}
+
+		{
+			Timer timer("parallelForEach");
+			ecs.view<const A, B>().parallelForEach([](ecs::entityId id, const A& a, B& b)
+				{
+					b.bf += sqrtf((float)a.a + b.bf);
+				});
+		}
+	}
+
+	float sum = 0.0f;
+	for (auto& [id, b] : ecs.view<const B>())
+		sum += b.bf;
+	printf("sum: %f\n", sum);
+}
+
+void benchmarkSystemGraph(int entityCount, int frames)
+{
+	printf("\nSystem graph benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	ecs.createEntities(entityCount, Particle{ 0, 0, 0, 1, 1, 1 });
+	ecs.createEntities(entityCount / 10, Big{});
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+
+	scheduler->addSystem<IncreaseAbs>();
+	scheduler->addSystem<MoveParticles>();
+	scheduler->addSystem<ScaleBigs>();
+	scheduler->addSystem<SumAbs>();
+	scheduler->compilePipeline();
+	for (size_t iSystem = 0; iSystem < scheduler->systems.size(); iSystem++)
+		printf("stage %d: %s\n", scheduler->systemStages[iSystem], typeid(*scheduler->systems[iSystem]).name());
+	printf("stages: %zu\n", scheduler->stageFirstTasks.size() - 1);
+
+	{
+		Timer timer("independent systems run concurrently");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->runSystems();
+		}
+	}
+}
+
+void benchmarkSystemPipeline(int systemCount, int frames)
+{
+	printf("\nSystem pipeline benchmark with %d systems, %d frames\n", systemCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	for (int i = 0; i < systemCount; i++)
+		scheduler->addSystem<ReadOnlySystem>();
+
+	{
+		Timer timer("compiled once");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->runSystems();
+		}
+	}
+
+	{
+		Timer timer("recompiled every frame");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->pipelineDirty = true;
+			scheduler->runSystems();
+		}
+	}
+}
+
+void benchmarkSystemStress(int systemCount, int entityCount, int frames)
+{
+	printf("\nSystem stress benchmark with %d independent systems, %d entities, %d frames\n", systemCount, entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	for (int i = 0; i < systemCount; i++)
+		scheduler->addSystem<SumAs>();
+	scheduler->addSystem<IncreaseAbs>();	// writes A, gets its own stage after the readers
+	scheduler->compilePipeline();
+	printf("stages: %zu\n", scheduler->stageFirstTasks.size() - 1);
+
+	{
+		Timer timer("stress");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->runSystems();
+		}
+	}
+}
+
+void benchmarkTaskArena(int entityCount, int frames)
+{
+	printf("\nTask arena benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, Big{});	// a big component means few entities per chunk and a task per chunk
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	scheduler->addSystem<ScaleBigs>();
+
+	{
+		Timer timer("frames");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->runSystems();
+		}
+	}
+
+	ecs::TaskArena::Stats stats = scheduler->taskArena.getStats();
+	printf("blocks: %zu, reserved: %zu bytes, high water mark: %zu bytes, allocations: %zu\n", stats.blockCount, stats.reservedBytes, stats.highWaterMark, stats.allocationCount);
+}
+
+void benchmarkTaskGranularity(int entityCount, int frames)
+{
+	printf("\nTask granularity benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs::EntityRange ids = ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+	for (int i = 0; i < entityCount; i++)
+	{
+		if (i % 10 != 0)
+			ecs.deleteEntity(ids[i]);	// leaves every chunk a tenth full
+	}
+
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	scheduler->addSystem<IncreaseAbs>();
+	for (bool autoTune : { false, true })
+	{
+		scheduler->autoTuneTaskSize = autoTune;
+		size_t allocationCount = scheduler->taskArena.getStats().allocationCount;
+		{
+			Timer timer(autoTune ? "auto tuned task size" : "fixed task size");
+			for (int frame = 0; frame < frames; frame++)
+			{
+				scheduler->runSystems();
+			}
+		}
+		printf("arena allocations per frame (tasks and task arrays): %zu\n", (scheduler->taskArena.getStats().allocationCount - allocationCount) / frames);
+	}
+}
+
+void benchmarkChunkJobs(int entityCount, int frames)
+{
+	printf("\nChunk job benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 1 }, B{ 1, 1.0f });
+
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	for (bool singleThreaded : { true, false })
+	{
+		scheduler->singleThreadedMode = singleThreaded;
+		ecs::System* system = scheduler->addSystem<BlendBs>();
+		{
+			Timer timer(singleThreaded ? "JOB_SET_FN job, single threaded" : "JOB_SET_FN job");
+			for (int frame = 0; frame < frames; frame++)
+			{
+				scheduler->runSystems();
+			}
+		}
+		scheduler->removeSystem(system);
+
+		system = scheduler->addSystem<BlendBsChunked>();
+		{
+			Timer timer(singleThreaded ? "ChunkJob, single threaded" : "ChunkJob");
+			for (int frame = 0; frame < frames; frame++)
+			{
+				scheduler->runSystems();
+			}
+		}
+		scheduler->removeSystem(system);
+	}
+
+	float sum = 0;
+	for (auto& [id, b] : ecs.view<const B>())
+		sum += b.bf;
+	printf("sum: %f\n", sum);
+}
+
+void benchmarkJobOverlap(int entityCount, int frames)
+{
+	printf("\nJob overlap benchmark with %d entities, %d frames\n", entityCount, frames);
+	ecs::Ecs ecs;
+	registerTestTypes(ecs);
+	ecs.createEntities(entityCount, A{ 0 }, B{ 0, 0.0f });
+	ecs.createEntities(entityCount, Particle{ 0, 0, 0, 1, 2, 3, 0 });
+
+	auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
+	OverlappingJobs* system = scheduler->addSystem<OverlappingJobs>();
+	for (bool waitEachJob : { true, false })
+	{
+		system->waitEachJob = waitEachJob;
+		Timer timer(waitEachJob ? "waiting after every job" : "overlapping jobs");
+		for (int frame = 0; frame < frames; frame++)
+		{
+			scheduler->runSystems();
+		}
+	}
+
+}
+
+void main(int argc, char* argv[])
 {
 	EASY_PROFILER_ENABLE;
 	profiler::startListen();
@@ -149,8 +1739,7 @@ void main()
 
 	{
 		ecs::Ecs ecs;
-		ecs.registerType<A>("AComp");
-		ecs.registerType<B>("BComp");
+		registerTestTypes(ecs);
 
 		// CREATE FROM CODE
 		ecs.createEntity(A{ 2 }, B{ 2, 2.0f });
@@ -175,9 +1764,7 @@ void main()
 	{
 		printf("\n\nNEW ECS CREATED!\n\n");
 		ecs::Ecs ecs;
-		ecs.registerType<A>("AComp");
-		ecs.registerType<B>("BComp");
-		ecs.registerType<C>("CComp");
+		registerTestTypes(ecs);
 
 		for (int i = 0; i < 10; i++)
 		{
@@ -195,9 +1782,7 @@ void main()
 		ecs::Ecs ecs;
 		auto scheduler = std::make_unique<ecs::Scheduler>(&ecs);
 
-		ecs.registerType<A>("AComp");
-		ecs.registerType<B>("BComp");
-		ecs.registerType<C>("CComp");
+		registerTestTypes(ecs);
 
 		stream.reset();
 		ecs.load(stream);
@@ -218,13 +1803,13 @@ void main()
 			}
 		}
 
+		scheduler->addSystem<IncreaseAbs>();
 		{
 			EASY_BLOCK("MULTITHREADED");
 			Timer timer("MULTITHREADED");
 			for (int i = 0; i < 20; i++)
 			{
 				EASY_BLOCK("Scheduled Run");
-				scheduler->scheduleSystem<IncreaseAbs>();
 				scheduler->runSystems();
 			}
 		}
@@ -236,7 +1821,6 @@ void main()
 			for (int i = 0; i < 20; i++)
 			{
 				EASY_BLOCK("Scheduled Run");
-				scheduler->scheduleSystem<IncreaseAbs>();
 				scheduler->runSystems();
 			}
 		}
@@ -254,5 +1838,50 @@ void main()
 		printABs(ecs, 10);
 	}
 
+	testEntityTableChurn(10000, 20);
+	testChunkRecycling(10000, 10);
+	testSaveLoad(1000);
+	testBatchedMoves(10000);
+	testChunkSizes(10000);
+	testFieldByField(10000);
+	testChunkAlignment(10000);
+	testCreateWhileIterating(100000);
+	testTypeLimit();
+	testChangeFilter(100000, 10);
+	testComponentEvents(10000, 100);
+	testParallelForEach(100000);
+	testSystemOrder(10000, 5);
+	testTaskSplitting(10007, 5);
+	testChunkJobs(100000, 5);
+	testJobHandles(100000, 5);
+	testJobOverlap(10000, 5);
+	printf("\nfailed checks: %d\n", failedCheckCount);
+
+	// the timings take minutes, they only run with the --benchmarks argument
+	bool runBenchmarks = argc > 1 && strcmp(argv[1], "--benchmarks") == 0;
+	if (runBenchmarks)
+	{
+		benchmarkEntityLocations(1000000);
+		benchmarkBulkCreation(100000);
+		benchmarkChunkChurn(100000, 20, false);
+		benchmarkChunkChurn(100000, 20, true);
+		benchmarkBatchedMoves(100000);
+		benchmarkChunkSizes(1000000, 20);
+		benchmarkSoA(1000000, 20);
+		benchmarkChunkIteration(1000000, 20);
+		benchmarkViewAcquire(100000, 10000);
+		benchmarkArchetypeMatching(250, 2000, 1000);
+		benchmarkChangeFilter(1000000, 20);
+		benchmarkComponentEvents(1000000, 20);
+		benchmarkParallelForEach(1000000, 20);
+		benchmarkSystemGraph(100000, 20);
+		benchmarkSystemPipeline(32, 1000);
+		benchmarkSystemStress(48, 100000, 20);
+		benchmarkTaskArena(1000000, 20);
+		benchmarkTaskGranularity(1000000, 20);
+		benchmarkChunkJobs(1000000, 20);
+		benchmarkJobOverlap(1000000, 20);
+	}
+
 	while (true);
 }